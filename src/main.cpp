@@ -1,18 +1,42 @@
 #include <ftw.h>
 #include <time.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <string.h>
 #include <dirent.h>
+#include <sched.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
-
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <map>
+#include <list>
+#include <mutex>
+#include <deque>
+#include <atomic>
 #include <chrono>
+#include <memory>
+#include <string>
 #include <vector>
 #include <thread>
 #include <fstream>
 #include <optional>
 #include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <condition_variable>
 
 #define SCRATCH_BUFFER_IMPLEMENTATION
 #include "scratch_buffer.h"
@@ -28,6 +52,8 @@
 
 #include <raylib.h>
 
+#include <jpeglib.h>
+
 #include <opencv2/opencv.hpp>
 #include <opencv2/imgcodecs.hpp>
 
@@ -45,6 +71,7 @@ using namespace TagLib;
 
 #define MP4_MAGIC_BYTES "\x66\x74\x79\x70"
 #define PNG_MAGIC_BYTES "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A"
+#define JPEG_MAGIC_BYTES "\xFF\xD8\xFF"
 
 #define TILE_COLOR DARKGRAY
 #define BACKGROUND_COLOR ((Color) {24, 24, 24, 255})
@@ -102,6 +129,10 @@ static float scroll_speed = DEFAULT_SCROLL_SPEED;
 
 #define tile_full_height (tile_height + tile_spacing)
 
+// The longer side of a tile minus its padding, published by the main thread for the loader and the decoders,
+// which must not read the tile size itself while it's being zoomed
+static std::atomic<int> tile_box_size = {std::max(DEFAULT_TILE_WIDTH, DEFAULT_TILE_HEIGHT) - DEFAULT_TEXT_PADDING};
+
 static bool delete_mode = false;
 static bool delete_failed = false;
 static char *delete_fail = NULL;
@@ -180,8 +211,7 @@ static float scale = DEFAULT_SCALE;
 } while (0)
 
 #define INIT_IMG_VALUE(...) \
-	img_value_t __VA_ARGS__##img = { \
-		.src_img = __VA_ARGS__##placeholder_src, \
+	__VA_ARGS__##placeholder_img = (img_value_t) { \
 		.scaled_img = __VA_ARGS__##scaled_img, \
 		.is_placeholder = true, \
 		.loaded_texture = LoadTextureFromImage(__VA_ARGS__##scaled_img) \
@@ -243,11 +273,27 @@ static const char *const IMAGE_FILE_EXTENSIONS[] = {"png", "jpg", "bmp", "tga",
 DEFINE_SIZE(IMAGE_FILE_EXTENSIONS);
 DEFINE_IS(image, IMAGE_FILE_EXTENSIONS);
 
+// TIFF based RAW formats, previewed through the JPEGs the camera embeds in them
+static const char *const RAW_FILE_EXTENSIONS[] = {"cr2", "nef", "nrw", "arw", "srw", "pef", "dng"};
+DEFINE_SIZE(RAW_FILE_EXTENSIONS);
+
 struct img_value_t {
-	Image src_img;
+	// Previews are kept at the size of the thumbnail flavor they came from and the GPU fits them into the tile,
+	// so zooming only ever needs a bigger flavor, placeholders are scaled to the tile
 	Image scaled_img;
 	bool is_placeholder;
 	std::optional<Texture2D> loaded_texture;
+	// Size of the thumbnail flavor `scaled_img` was fit into, 0 if it's the original
+	int thumb_size;
+	// A placeholder whose preview was skipped or thrown away to stay under the memory cap,
+	// it's loaded again once its tile gets close to the screen
+	bool evicted;
+	// `render_frame` the tile was last drawn in, the least recently drawn previews are evicted first
+	uint64_t last_drawn;
+	// QOI encoded pixels of a preview that was decoded away from the screen, `scaled_img` holds none meanwhile,
+	// the decoders unpack them once the tile gets close to the screen
+	uint8_t *qoi;
+	int qoi_size;
 };
 
 struct img_map_t {
@@ -255,6 +301,13 @@ struct img_map_t {
 	img_value_t value;
 };
 
+#define DEFINE_PLACEHOLDER_IMG(...) \
+	static img_value_t __VA_ARGS__##placeholder_img = {}
+
+#define X DEFINE_PLACEHOLDER_IMG
+XPLACEHOLDERS
+#undef X
+
 struct path_t {
 	char *str;
 	size_t ino;
@@ -262,6 +315,8 @@ struct path_t {
 	long size;
 	uint8_t type;
 	bool abs, deleted;
+	// `mtim` and `size` are filled lazily, see `fill_metadata`
+	bool has_meta;
 };
 
 INLINE static path_t new_path(char *str,
@@ -277,24 +332,60 @@ INLINE static path_t new_path(char *str,
 		.type = type,
 		.abs = abs,
 		.deleted = false,
+		.has_meta = true,
 	};
 }
 
 static img_map_t *img_map = NULL;
 static std::vector<path_t> paths = {};
 
-// in millis
-#define PREVIEW_LOADER_SLEEP_TIME 256
+// Guards `img_map`, which the preview loader updates from its own thread
+static std::mutex img_map_mtx;
 
-// Flags to communicate with the thread that loads previews
-static bool stop_flag = false;
-static bool idle_flag = false;
+// Previews are decoded by a pool of workers, one per available core unless `FE_DECODE_THREADS` says otherwise
+#define DECODE_THREADS_ENV "FE_DECODE_THREADS"
+
+// Flags to communicate with the thread that loads previews, `stop_flag` and `idle_flag` are written
+// under a mutex but polled without one by every background thread
+static std::atomic<bool> stop_flag = {false};
+static std::atomic<bool> idle_flag = {false};
 static bool new_scale_flag = false;
 
+// The loader sleeps on `loader_cv` until there's work, `loader_wakes` tells it whether
+// it was woken up again while it was busy, guarded by `loader_mtx` along with `new_scale_flag`
+static std::mutex loader_mtx;
+static std::condition_variable loader_cv;
+static size_t loader_wakes = 0;
+static bool loader_prefetch_ready = false;
+
+// Bumped on every directory change, preview work of an older generation is thrown away,
+// `decode_job_gen` is the generation of whatever the current decoder thread is working on
+static std::atomic<size_t> preview_gen = {0};
+static thread_local size_t decode_job_gen = 0;
+
+INLINE static bool decode_cancelled(void)
+{
+	return decode_job_gen != preview_gen || stop_flag;
+}
+
+// Wakes the preview loader up, `rescale` also has it rescale the previews that are loaded already
+static void wake_loader(bool rescale = false)
+{
+	{
+		std::lock_guard<std::mutex> lock(loader_mtx);
+		idle_flag = false;
+		if (rescale) new_scale_flag = true;
+		loader_wakes++;
+	}
+	loader_cv.notify_one();
+}
+
 INLINE static int pixel_format_to_amount_of_bytes(int pixel_format)
 {
 	switch (pixel_format) {
-	case PIXELFORMAT_UNCOMPRESSED_R8G8B8:	return 3;
+	case PIXELFORMAT_UNCOMPRESSED_GRAYSCALE:	return 1;
+	case PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA: return 2;
+	case PIXELFORMAT_UNCOMPRESSED_R8G8B8:			return 3;
 	default: return 4;
 	}
 }
@@ -324,6 +415,7 @@ INLINE static void update_offset_if_tile_is_not_visible(Vector2i tile_pos)
 }
 
 INLINE static int get_tiles_per_row(void);
+INLINE static int get_tiles_per_col(void);
 INLINE static Vector2i idx_to_tile_pos(size_t idx);
 
 INLINE static Vector2i get_tile_pos_from_ino(size_t ino)
@@ -366,12 +458,12 @@ static void set_new_scale(float new_scale)
 	text_padding = DEFAULT_TEXT_PADDING*scale;
 	font_size		 = DEFAULT_FONT_SIZE   *scale;
 	text_spacing = DEFAULT_TEXT_SPACING*scale;
+	tile_box_size = std::max(tile_width, tile_height) - text_padding;
 
 	UnloadFont(font);
 	font = LoadFontEx(FONT_PATH, font_size, NULL, 0);
 
-	new_scale_flag = true;
-	idle_flag = false;
+	wake_loader(true);
 
 	if (placeholder_resized) {
 		RELOAD_PLACEHOLDER();
@@ -386,8 +478,287 @@ static void set_new_scale(float new_scale)
 
 INLINE static char *scratch_buffer_append_full_file_path(char *file_path);
 
-static void read_dir(void)
+INLINE static bool getenv_flag(const char *name, bool default_value = false)
+{
+	const char *value = getenv(name);
+	if (value == NULL || *value == '\0') return default_value;
+	return !streq(value, "0");
+}
+
+INLINE static size_t getenv_size(const char *name, size_t default_value)
+{
+	const char *value = getenv(name);
+	if (value == NULL || *value == '\0') return default_value;
+
+	char *end = NULL;
+	const unsigned long long n = strtoull(value, &end, 10);
+	return end == value ? default_value : (size_t) n;
+}
+
+// Big enough to pull a few thousand entries out of the kernel per `getdents64` call
+#define SCAN_BATCH_SIZE (256*1024)
+
+// Only the fields that `path_t` actually uses, `STATX_TYPE` is there for `DT_UNKNOWN` entries
+#define SCAN_STATX_MASK (STATX_TYPE | STATX_INO | STATX_MTIME | STATX_SIZE)
+
+// Set `FE_SCAN_STATS=1` to print the throughput of every directory scan,
+// set `FE_LEGACY_SCAN=1` to go through `readdir` + `stat` instead, to have something to compare against
+#define SCAN_STATS_ENV "FE_SCAN_STATS"
+#define LEGACY_SCAN_ENV "FE_LEGACY_SCAN"
+
+// Lazy metadata is on by default: the listing is built straight from `d_name`/`d_type`
+// and `mtim`/`size` are filled in the background, set `FE_LAZY_METADATA=0` to stat eagerly
+#define LAZY_METADATA_ENV "FE_LAZY_METADATA"
+
+// How many stat results the metadata filler collects before handing them over
+#define METADATA_BATCH_SIZE 64
+
+// Memory cap of the cache of directory listings, in megabytes
+#define DIR_CACHE_ENV "FE_DIR_CACHE_MB"
+#define DEFAULT_DIR_CACHE_MB 64
+
+// How long the selection has to rest on a directory before it gets prefetched, in seconds
+#define PREFETCH_DELAY 0.3f
+
+// Prefetching a directory bigger than that is given up on
+#define PREFETCH_MAX_ENTRIES_ENV "FE_PREFETCH_MAX_ENTRIES"
+#define DEFAULT_PREFETCH_MAX_ENTRIES 50000
+
+// Niceness of the prefetcher thread, so it stays out of the way of everything that's on screen
+#define PREFETCH_NICE 10
+
+// Recursive sizes of directories are computed in the background, set `FE_DIR_SIZES=0` to turn that off,
+// `FE_DIR_SIZE_THREADS` overrides the amount of walker threads
+#define DIR_SIZES_ENV "FE_DIR_SIZES"
+#define DIR_SIZE_THREADS_ENV "FE_DIR_SIZE_THREADS"
+#define MAX_DIR_SIZE_THREADS 8
+
+// Memory cap of the cache of already walked directories, in megabytes
+#define DIR_SIZE_CACHE_ENV "FE_DIR_SIZE_CACHE_MB"
+#define DEFAULT_DIR_SIZE_CACHE_MB 64
+
+// How long the mouse has to rest on a video tile before its scrub strip is made, in seconds
+#define SCRUB_HOVER_DELAY 0.25f
+
+// Memory cap of the scrub strips of video tiles, in megabytes
+#define SCRUB_CACHE_ENV "FE_SCRUB_CACHE_MB"
+#define DEFAULT_SCRUB_CACHE_MB 64
+
+// Memory cap of the preview pixels that are waiting in the img map for their upload, QOI encoded or not, in megabytes,
+// what's uploaded only lives on the GPU, set `FE_MEMORY_STATS=1` to print what's resident every now and then
+#define MEMORY_ENV "FE_MEMORY_MB"
+#define DEFAULT_MEMORY_MB 256
+#define MEMORY_STATS_ENV "FE_MEMORY_STATS"
+
+// How much time and texture memory the uploads of previews may take per frame, in milliseconds and megabytes,
+// at least one goes up every frame however big it is
+#define UPLOAD_BUDGET_MS 4.0
+#define UPLOAD_BUDGET_MB 16
+
+// Memory cap of the textures of previews, in megabytes
+#define TEXTURE_ENV "FE_TEXTURE_MB"
+#define DEFAULT_TEXTURE_MB 512
+
+// How many entries of other directories the img map may hold on to before it's swept
+#define IMG_MAP_SLACK 4096
+
+// How often the previews over the memory cap are looked for, and the stats are printed, in seconds
+#define MEMORY_EVICT_INTERVAL 0.25f
+#define MEMORY_STATS_INTERVAL 1.0f
+
+// Resident preview pixels, in bytes, scrub strips keep their own count in `scrub_strips_bytes`
+enum {
+	PIXELS_DECODED,
+	PIXELS_PACKED,
+	PIXELS_COMPRESSED,
+	PIXELS_TEXTURES,
+	PIXELS_CATEGORIES
+};
+
+static std::atomic<size_t> pixel_bytes[PIXELS_CATEGORIES] = {};
+
+struct linux_dirent64_t {
+	ino64_t d_ino;
+	off64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+typedef struct {
+	size_t entries;
+	size_t batches;
+	size_t stats;
+	double secs;
+} scan_stats_t;
+
+// Accumulated over the whole session
+static scan_stats_t scan_stats = {0};
+
+// Bumped on every directory (re)scan, so results of the previous one can be told apart
+static size_t dir_gen = 0;
+
+// How many entries the scanner collects before handing them over to the main thread,
+// small enough for the first screenful to show up within a frame
+#define SCAN_CHUNK_SIZE 256
+
+#define NAME_POOL_BLOCK_SIZE (64*1024)
+
+// Names of the entries of one listing, `path_t.str` points in here. The scanner
+// thread can't use the char arena, so every listing gets its own pool, which lives
+// as long as anything (`paths`, the scanner) still refers to it
+struct name_pool_t {
+	std::vector<char *> blocks = {};
+	size_t used = NAME_POOL_BLOCK_SIZE;
+	size_t bytes = 0;
+
+	char *copy(const char *str, size_t len)
+	{
+		const size_t size = len + 1;
+		if (used + size > NAME_POOL_BLOCK_SIZE) {
+			const size_t block_size = std::max((size_t) NAME_POOL_BLOCK_SIZE, size);
+			blocks.push_back((char *) malloc(block_size));
+			bytes += block_size;
+			used = 0;
+		}
+
+		char *dst = blocks.back() + used;
+		memcpy(dst, str, len);
+		dst[len] = '\0';
+		used += size;
+		return dst;
+	}
+
+	~name_pool_t()
+	{
+		for (auto block: blocks) free(block);
+	}
+};
+
+typedef struct {
+	size_t idx;
+	size_t ino;
+	const char *name;
+} meta_req_t;
+
+typedef struct {
+	size_t idx;
+	size_t ino;
+	timespec mtim;
+	long size;
+	uint8_t type;
+} meta_result_t;
+
+typedef struct {
+	size_t gen;
+	std::shared_ptr<name_pool_t> names;
+	std::vector<path_t> entries;
+	bool finished;
+} scan_chunk_t;
+
+// Communication with the thread that scans directories and fills metadata in,
+// everything except the atomics is guarded by `scan_mtx`
+static std::mutex scan_mtx;
+static std::condition_variable scan_cv;
+static std::condition_variable scan_done_cv;
+static bool scan_requested = false;
+static std::string scan_req_dir = {};
+static size_t scan_req_gen = 0;
+// Set for requests that only need the metadata of an already known listing filled in
+static std::shared_ptr<name_pool_t> scan_req_names = nullptr;
+static std::vector<meta_req_t> scan_req_meta = {};
+static std::vector<scan_chunk_t> scan_chunks = {};
+static std::vector<meta_result_t> meta_results = {};
+static size_t meta_results_gen = 0;
+
+// Generation the scanner should be working on, anything else is cancelled
+static std::atomic<size_t> scan_gen = {0};
+
+// Range of listing indices that is currently on screen, gets stat'ed first
+static std::atomic<size_t> meta_hint_first = {0};
+static std::atomic<size_t> meta_hint_last = {0};
+
+// Guards structural changes of `paths` (and `to_load`), which the preview loader reads from its own thread
+static std::mutex paths_mtx;
+
+// State of the current scan, only touched by the main thread
+static bool scanning = false;
+static size_t scan_total = 0;
+static size_t meta_pending = 0;
+static std::shared_ptr<name_pool_t> curr_names = nullptr;
+// Entries dropped in while scanning shift `paths`, so listing indices are mapped to `paths` indices
+static std::vector<size_t> scan_idx_to_path_idx = {};
+
+static std::atomic<bool> statx_unsupported = {false};
+
+INLINE static double get_monotonic_time(void)
+{
+	struct timespec ts = {0};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// `stat` the entry relatively to the already opened directory, so the kernel
+// doesn't have to walk the whole path from the root for every single entry
+static bool stat_entry_at(int dir_fd, const char *name, path_t *path)
+{
+	if (!statx_unsupported) {
+		struct statx stx = {0};
+		if (statx(dir_fd, name, AT_NO_AUTOMOUNT, SCAN_STATX_MASK, &stx) == 0) {
+			path->ino = (size_t) stx.stx_ino;
+			path->mtim.tv_sec = stx.stx_mtime.tv_sec;
+			path->mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+			path->size = (long) stx.stx_size;
+			if (path->type == DT_UNKNOWN && (stx.stx_mask & STATX_TYPE)) {
+				path->type = IFTODT(stx.stx_mode);
+			}
+			return true;
+		}
+
+		if (errno != ENOSYS) return false;
+		statx_unsupported = true;
+	}
+
+	struct stat info = {0};
+	if (fstatat(dir_fd, name, &info, AT_NO_AUTOMOUNT) == -1) return false;
+
+	path->ino = (size_t) info.st_ino;
+	path->mtim = info.st_mtim;
+	path->size = info.st_size;
+	if (path->type == DT_UNKNOWN) path->type = IFTODT(info.st_mode);
+	return true;
+}
+
+static void report_scan_stats(const scan_stats_t *stats, const char *dir, const char *engine)
 {
+	scan_stats.entries += stats->entries;
+	scan_stats.batches += stats->batches;
+	scan_stats.stats += stats->stats;
+	scan_stats.secs += stats->secs;
+
+	static const bool enabled = getenv_flag(SCAN_STATS_ENV);
+	if (!enabled) return;
+
+	const double secs = stats->secs > 0.0 ? stats->secs : 1e-9;
+	eprintf("[%s] scanned %zu entries of %s in %.3f ms (%.0f entries/s, %zu batches, %zu stats), "
+					"session total: %zu entries in %.3f ms\n",
+					engine,
+					stats->entries,
+					dir,
+					stats->secs*1e3,
+					stats->entries / secs,
+					stats->batches,
+					stats->stats,
+					scan_stats.entries,
+					scan_stats.secs*1e3);
+}
+
+// The old engine: full path + `stat` for every `readdir` entry, runs synchronously, kept for comparison
+static void read_dir_legacy(void)
+{
+	scan_stats_t stats = {0};
+	const double start = get_monotonic_time();
+
 	DIR *dir = opendir(curr_dir);
 	if (dir == NULL) {
 		eprintf("could not open directory %s: %s", curr_dir, strerror(errno));
@@ -413,7 +784,12 @@ static void read_dir(void)
 																	 (uint8_t) e->d_type,
 																	 false);
 
-			paths.emplace_back(path);
+			{
+				std::lock_guard<std::mutex> lock(paths_mtx);
+				paths.emplace_back(path);
+			}
+			stats.entries++;
+			stats.stats++;
 		}
 		e = readdir(dir);
 	}
@@ -425,703 +801,4312 @@ static void read_dir(void)
 	}
 
 	closedir(dir);
-}
 
-INLINE static size_t get_tiles_count(void)
-{
-	return paths.size();
+	stats.secs = get_monotonic_time() - start;
+	report_scan_stats(&stats, curr_dir, "readdir");
 }
 
-INLINE static int get_tiles_per_col(void)
+static void post_scan_chunk(size_t gen,
+														const std::shared_ptr<name_pool_t> &names,
+														std::vector<path_t> *entries,
+														bool finished)
 {
-	return GetScreenHeight() / (tile_height + tile_spacing);
+	std::lock_guard<std::mutex> lock(scan_mtx);
+	if (scan_gen != gen) return;
+
+	scan_chunks.push_back((scan_chunk_t) {
+		.gen = gen,
+		.names = names,
+		.entries = std::move(*entries),
+		.finished = finished,
+	});
+
+	entries->clear();
+	scan_done_cv.notify_all();
 }
 
-INLINE static int get_tiles_per_row(void)
+INLINE static void flush_metadata(std::vector<meta_result_t> *batch, size_t gen)
 {
-	return GetScreenWidth() / (tile_width + tile_spacing);
+	if (batch->empty()) return;
+
+	std::lock_guard<std::mutex> lock(scan_mtx);
+	if (meta_results_gen != gen) {
+		meta_results.clear();
+		meta_results_gen = gen;
+	}
+	meta_results.insert(meta_results.end(), batch->begin(), batch->end());
+	batch->clear();
+	scan_done_cv.notify_all();
 }
 
-INLINE static char *join_dir(const char *dir_path)
+// Stats the entries of a finished listing, the ones on screen first
+static void fill_metadata(int dir_fd, size_t gen, const std::vector<meta_req_t> &reqs)
 {
-	scratch_buffer_clear();
-	scratch_buffer_append(curr_dir);
-	scratch_buffer_append_char('/');
-	scratch_buffer_append(dir_path);
-	return scratch_buffer_copy();
+	std::vector<bool> done(reqs.size(), false);
+	std::vector<meta_result_t> batch = {};
+	size_t next = 0;
+	size_t left = reqs.size();
+
+	while (left > 0 && scan_gen == gen && !stop_flag) {
+		// `reqs` are in listing order, so the visible range can be found with a binary search
+		const size_t first = meta_hint_first, last = meta_hint_last;
+		auto it = std::lower_bound(reqs.begin(), reqs.end(), first,
+															 [] (const meta_req_t &r, size_t idx) { return r.idx < idx; });
+
+		size_t i = reqs.size();
+		for (; it != reqs.end() && it->idx <= last; ++it) {
+			const size_t j = it - reqs.begin();
+			if (!done[j]) {
+				i = j;
+				break;
+			}
+		}
+
+		if (i == reqs.size()) {
+			while (done[next]) next++;
+			i = next;
+		}
+
+		const meta_req_t *req = &reqs[i];
+		path_t path = {0};
+		path.type = DT_UNKNOWN;
+		stat_entry_at(dir_fd, req->name, &path);
+
+		batch.push_back((meta_result_t) {
+			.idx = req->idx,
+			.ino = req->ino,
+			.mtim = path.mtim,
+			.size = path.size,
+			.type = path.type,
+		});
+
+		done[i] = true;
+		left--;
+
+		if (batch.size() >= METADATA_BATCH_SIZE) flush_metadata(&batch, gen);
+	}
+
+	flush_metadata(&batch, gen);
 }
 
-INLINE static void preserve_tile_pos(size_t tile_idx)
+// Lists `dir` in `getdents64` batches, handing entries over in chunks as it goes,
+// then fills the metadata in if it's lazy. Runs on the scanner thread
+static void scan_dir(const char *dir, size_t gen)
 {
-	if (streq(paths[tile_idx].str, "..")) {
-		scroll_offset_y = last_scroll_offset_y;
-		selected_tile_pos.x = selected_tile_pos_before_entering_dir.x;
-		selected_tile_pos.y = selected_tile_pos_before_entering_dir.y;
-	} else {
-		selected_tile_pos_before_entering_dir.x = selected_tile_pos.x;
-		selected_tile_pos_before_entering_dir.y = selected_tile_pos.y;
-		memset(&selected_tile_pos, 0, sizeof(selected_tile_pos));
-		last_scroll_offset_y = scroll_offset_y;
-		scroll_offset_y = 0.0;
+	static const bool lazy = getenv_flag(LAZY_METADATA_ENV, true);
+
+	scan_stats_t stats = {0};
+	const double start = get_monotonic_time();
+
+	auto names = std::make_shared<name_pool_t>();
+	std::vector<path_t> chunk = {};
+	std::vector<meta_req_t> reqs = {};
+
+	const int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd == -1) {
+		eprintf("could not open directory %s: %s\n", dir, strerror(errno));
+		post_scan_chunk(gen, names, &chunk, true);
+		return;
+	}
+
+	char *batch = (char *) malloc(SCAN_BATCH_SIZE);
+
+	while (scan_gen == gen && !stop_flag) {
+		const long n = syscall(SYS_getdents64, dir_fd, batch, SCAN_BATCH_SIZE);
+		if (n == 0) break;
+		if (n == -1) {
+			eprintf("could not read directory %s: %s\n", dir, strerror(errno));
+			break;
+		}
+
+		stats.batches++;
+
+		for (long off = 0; off < n;) {
+			const linux_dirent64_t *e = (linux_dirent64_t *) (batch + off);
+			off += e->d_reclen;
+
+			if (streq(e->d_name, ".")) continue;
+
+			path_t path = {
+				.str = names->copy(e->d_name, strlen(e->d_name)),
+				.ino = (size_t) e->d_ino,
+				.mtim = {0},
+				.size = 0,
+				.type = e->d_type,
+				.abs = false,
+				.deleted = false,
+				.has_meta = !lazy,
+			};
+
+			if (lazy) {
+				reqs.push_back((meta_req_t) {
+					.idx = stats.entries,
+					.ino = path.ino,
+					.name = path.str,
+				});
+			} else {
+				if (!stat_entry_at(dir_fd, e->d_name, &path)) {
+					eprintf("failed to stat %s/%s: %s\n", dir, e->d_name, strerror(errno));
+				}
+				stats.stats++;
+			}
+
+			chunk.emplace_back(path);
+			stats.entries++;
+
+			if (chunk.size() >= SCAN_CHUNK_SIZE) post_scan_chunk(gen, names, &chunk, false);
+		}
+
+		if (!chunk.empty()) post_scan_chunk(gen, names, &chunk, false);
 	}
+
+	free(batch);
+
+	post_scan_chunk(gen, names, &chunk, true);
+
+	stats.secs = get_monotonic_time() - start;
+	report_scan_stats(&stats, dir, "getdents64");
+
+	if (lazy) fill_metadata(dir_fd, gen, reqs);
+	close(dir_fd);
 }
 
-INLINE static Vector2i idx_to_tile_pos(size_t idx)
+// The scanner thread, picks up the latest requested directory, older requests are simply dropped
+static void scan_dirs(void)
 {
-	const size_t tpr = get_tiles_per_row();
-	return (Vector2i) {
-		(int) (idx % tpr),
-		(int) (idx / tpr)
-	};
+	std::unique_lock<std::mutex> lock(scan_mtx);
+	while (true) {
+		scan_cv.wait(lock, [] { return stop_flag || scan_requested; });
+		if (stop_flag) break;
+
+		scan_requested = false;
+		const std::string dir = scan_req_dir;
+		const size_t gen = scan_req_gen;
+		const std::shared_ptr<name_pool_t> names = std::move(scan_req_names);
+		const std::vector<meta_req_t> reqs = std::move(scan_req_meta);
+		scan_req_names = nullptr;
+		scan_req_meta.clear();
+		lock.unlock();
+
+		if (names == nullptr) {
+			scan_dir(dir.c_str(), gen);
+		} else {
+			const int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (dir_fd != -1) {
+				fill_metadata(dir_fd, gen, reqs);
+				close(dir_fd);
+			} else {
+				eprintf("could not open directory %s: %s\n", dir.c_str(), strerror(errno));
+			}
+		}
+
+		lock.lock();
+	}
 }
 
-INLINE static Vector2 get_tile_pos(size_t tile_pos_x, size_t tile_pos_y)
+static void fill_img_map(size_t from, bool keep_loaded);
+static void fill_img_map_of(const std::vector<path_t> &list, size_t from, size_t to, bool keep_loaded);
+
+// Starts listing `curr_dir` into the (already cleared) `paths`
+static void read_dir(void)
 {
-	return (Vector2) {
-		(float) tile_pos_x*(tile_width + tile_spacing) + tile_spacing,
-		tile_pos_y*(tile_height + tile_spacing) + tile_spacing - scroll_offset_y
-	};
+	static const bool legacy = getenv_flag(LEGACY_SCAN_ENV);
+
+	dir_gen++;
+	scan_total = 0;
+	meta_pending = 0;
+	scan_idx_to_path_idx.clear();
+
+	if (legacy) {
+		scanning = false;
+		read_dir_legacy();
+		fill_img_map(0, false);
+		return;
+	}
+
+	scanning = true;
+	scan_gen = dir_gen;
+
+	std::lock_guard<std::mutex> lock(scan_mtx);
+	scan_chunks.clear();
+	scan_requested = true;
+	scan_req_dir = curr_dir;
+	scan_req_gen = dir_gen;
+	scan_req_names = nullptr;
+	scan_req_meta.clear();
+	scan_cv.notify_one();
 }
 
-INLINE static char *get_top_file_path(char *src)
+// Pick up whatever the scanner has done so far, runs on the main thread every frame
+static void poll_dir_scan(void)
 {
-	for (int i = strlen(src) - 1; i >= 0; i--) {
-		if (src[i] == '/') {
-			return src + i + 1;
+	if (!scanning && meta_pending == 0) return;
+
+	const int tpr = get_tiles_per_row();
+	const size_t first_visible_row = scroll_offset_y / (tile_height + tile_spacing);
+	// These are `paths` indices, which only differ from listing indices if something was dropped in meanwhile
+	meta_hint_first = first_visible_row*tpr;
+	meta_hint_last = (first_visible_row + get_tiles_per_col() + 1)*tpr;
+
+	std::vector<scan_chunk_t> chunks = {};
+	std::vector<meta_result_t> results = {};
+	{
+		std::lock_guard<std::mutex> lock(scan_mtx);
+		chunks.swap(scan_chunks);
+		if (meta_results_gen == dir_gen) results.swap(meta_results);
+	}
+
+	for (auto &chunk: chunks) {
+		if (chunk.gen != dir_gen) continue;
+
+		curr_names = chunk.names;
+
+		const size_t from = paths.size();
+		{
+			std::lock_guard<std::mutex> lock(paths_mtx);
+			for (const auto &path: chunk.entries) {
+				scan_idx_to_path_idx.push_back(paths.size());
+				paths.emplace_back(path);
+				if (!path.has_meta) meta_pending++;
+			}
 		}
+
+		scan_total += chunk.entries.size();
+		fill_img_map(from, false);
+
+		if (!chunk.entries.empty()) wake_loader();
+		if (chunk.finished) scanning = false;
+	}
+
+	std::lock_guard<std::mutex> lock(paths_mtx);
+	for (const auto &r: results) {
+		meta_pending--;
+		if (r.idx >= scan_idx_to_path_idx.size()) continue;
+
+		path_t *path = &paths[scan_idx_to_path_idx[r.idx]];
+		if (path->ino != r.ino || path->has_meta) continue;
+
+		path->mtim = r.mtim;
+		path->size = r.size;
+		if (path->type == DT_UNKNOWN) path->type = r.type;
+		path->has_meta = true;
 	}
-	return src;
 }
 
-INLINE static char *get_extension(char *src)
+// Sorting needs the whole listing with `mtim`/`size` of every entry, so block until the scanner is done with them
+static void wait_for_metadata(void)
 {
-	for (int i = strlen(src) - 1; i >= 0; i--) {
-		if (src[i] == '.') {
-			char *ret = src + i + 1;
-			if (src[i + 1] == '/') ret++;
-			return ret;
+	poll_dir_scan();
+	while (scanning || meta_pending > 0) {
+		{
+			std::unique_lock<std::mutex> lock(scan_mtx);
+			scan_done_cv.wait_for(lock, std::chrono::milliseconds(10), [] {
+				return !scan_chunks.empty() || (meta_results_gen == dir_gen && !meta_results.empty());
+			});
 		}
+		poll_dir_scan();
 	}
-	return NULL;
 }
 
-static void fill_img_map(bool init);
+// A listing of a directory we've left, along with where we were in it
+struct dir_snapshot_t {
+	dev_t dev;
+	ino_t ino;
+	timespec mtim;
+	timespec ctim;
+	std::vector<path_t> paths;
+	std::shared_ptr<name_pool_t> names;
+	float scroll_offset_y;
+	Vector2i selected_tile_pos;
+	size_t bytes;
+};
+
+// Most recently left directory first, only touched by the main thread
+static std::list<dir_snapshot_t> dir_cache = {};
+static size_t dir_cache_bytes = 0;
+
+// `stat` of `curr_dir` taken right before it was listed, the listing is
+// at least as new as this, so it is what a cached snapshot gets validated against
+static struct stat curr_dir_info = {};
+static bool curr_dir_info_valid = false;
 
-INLINE static void enter_dir(char *dir, size_t tile_idx)
+INLINE static bool timespec_eq(timespec a, timespec b)
 {
-	curr_dir = dir;
-	idle_flag = true;
-	paths.clear();
-	read_dir();
-	fill_img_map(false);
-	idle_flag = false;
-	preserve_tile_pos(tile_idx);
+	return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
 }
 
-INLINE static void stop_rename_mode(void)
+INLINE static size_t get_dir_cache_cap(void)
 {
-	rename_mode = false;
-	rename_failed = false;
-	rename_fail = NULL;
-	rename_sure = false;
-	memset(rename_string, 0, rename_string_size);
-	rename_string_size = 0;
-	rename_ino = -1;
-	rename_tile_idx = -1;
+	static const size_t cap = getenv_size(DIR_CACHE_ENV, DEFAULT_DIR_CACHE_MB)*MB;
+	return cap;
 }
 
-INLINE static void stop_sort_mode(void)
+INLINE static size_t get_snapshot_bytes(size_t paths_count, const name_pool_t *names)
 {
-  sort_mode = false;
+	return sizeof(dir_snapshot_t) + paths_count*sizeof(path_t) + (names ? names->bytes : 0);
 }
 
-INLINE static void stop_search_mode(void)
+// Put `snapshot` in front of the cache, replacing an older one of the same directory
+static void cache_dir_snapshot(dir_snapshot_t &&snapshot)
 {
-	search_mode = false;
-	typing_search = false;
-	matched_idxs.clear();
-	memset(search_string, 0, search_string_size);
-	search_string_size = 0;
+	const size_t cap = get_dir_cache_cap();
+	if (snapshot.bytes > cap) return;
+
+	for (auto it = dir_cache.begin(); it != dir_cache.end(); ++it) {
+		if (it->dev == snapshot.dev && it->ino == snapshot.ino) {
+			dir_cache_bytes -= it->bytes;
+			dir_cache.erase(it);
+			break;
+		}
+	}
+
+	dir_cache_bytes += snapshot.bytes;
+	dir_cache.push_front(std::move(snapshot));
+
+	while (dir_cache_bytes > cap) {
+		dir_cache_bytes -= dir_cache.back().bytes;
+		dir_cache.pop_back();
+	}
 }
 
-INLINE static void stop_delete_mode(void)
+INLINE static bool find_dir_snapshot(const struct stat *info)
 {
-	delete_mode = false;
-	delete_failed = false;
-	delete_fail = NULL;
-	delete_sure = false;
-	delete_ino = -1;
-	delete_tile_idx = -1;
+	for (const auto &snapshot: dir_cache) {
+		if (snapshot.dev == info->st_dev && snapshot.ino == info->st_ino) {
+			return timespec_eq(snapshot.mtim, info->st_mtim) && timespec_eq(snapshot.ctim, info->st_ctim);
+		}
+	}
+	return false;
 }
 
-INLINE static void str_tolower(char *str)
+// Remember the listing of the directory we're about to leave
+static void save_dir_snapshot(void)
 {
-	for (char *p = str; p != NULL && *p != '\0'; p++, *p = tolower(*p));
+	// An incomplete listing would be mistaken for a complete one
+	if (!curr_dir_info_valid || scanning) return;
+
+	const size_t bytes = get_snapshot_bytes(paths.size(), curr_names.get());
+
+	dir_snapshot_t snapshot = {
+		.dev = curr_dir_info.st_dev,
+		.ino = curr_dir_info.st_ino,
+		.mtim = curr_dir_info.st_mtim,
+		.ctim = curr_dir_info.st_ctim,
+		.paths = {},
+		.names = curr_names,
+		.scroll_offset_y = scroll_offset_y,
+		.selected_tile_pos = selected_tile_pos,
+		.bytes = bytes,
+	};
+
+	{
+		std::lock_guard<std::mutex> lock(paths_mtx);
+		snapshot.paths = paths;
+	}
+
+	cache_dir_snapshot(std::move(snapshot));
 }
 
-INLINE static size_t get_tile_idx_from_tile_pos(Vector2i pos)
+// Swap in the cached listing of `curr_dir` if it's still valid, no per-entry syscalls involved
+static bool restore_dir_snapshot(void)
 {
-	return pos.x + pos.y*get_tiles_per_row();
-}
+	auto it = dir_cache.begin();
+	for (; it != dir_cache.end(); ++it) {
+		if (it->dev == curr_dir_info.st_dev && it->ino == curr_dir_info.st_ino) break;
+	}
 
-INLINE static void draw_text_boxed(Font font,
-																	 const char *text,
-																	 Rectangle rec,
-																	 bool word_wrap,
-																	 Color tint);
+	if (it == dir_cache.end()) return false;
 
-static void draw_text_truncated(const char *text,
-																Vector2 pos,
-																float max_text_width,
-																Color color);
+	if (!timespec_eq(it->mtim, curr_dir_info.st_mtim)
+	||  !timespec_eq(it->ctim, curr_dir_info.st_ctim))
+	{
+		dir_cache_bytes -= it->bytes;
+		dir_cache.erase(it);
+		return false;
+	}
 
-static void draw_ask_window(Color bg, Color tc, int pad, char *text)
-{
-	const int w = GetScreenWidth();
-	const int h = GetScreenHeight();
+	dir_gen++;
+	scan_gen = dir_gen;
+	scanning = false;
+	meta_pending = 0;
+	scan_idx_to_path_idx.clear();
 
-	const int rw = w / 3;
-	const int rh = h / 6;
-	const int rx = (w - rw) / 2;
-	const int ry = (h - rh) / 2;
+	{
+		std::lock_guard<std::mutex> lock(paths_mtx);
+		paths = std::move(it->paths);
+	}
 
-	DrawRectangle(rx, ry, rw, rh, bg);
+	curr_names = it->names;
+	scroll_offset_y = it->scroll_offset_y;
+	selected_tile_pos = it->selected_tile_pos;
+	scan_total = paths.size();
 
-	const Vector2 ts = MeasureTextEx(font, text, font_size, text_spacing);
-	const Vector2 tp = {
-		rx + (rw - ts.x) / 2,
-		ry + (rh - ts.y) / 2
-	};
+	dir_cache_bytes -= it->bytes;
+	dir_cache.erase(it);
 
-	if (ts.x < rw - 2*pad) {
-		draw_text_truncated(text, tp, rw, tc);
-	} else {
-		draw_text_boxed(font, text,
-										(Rectangle) {
-											(float) (rx + pad),
-											(float) (ry + pad),
-											(float) (rw - pad),
-											(float) (rh - pad)
-										}, true, tc);
+	fill_img_map(0, true);
+
+	// Entries which were still waiting for their metadata when we left
+	std::vector<meta_req_t> reqs = {};
+	for (size_t i = 0; i < paths.size(); ++i) {
+		scan_idx_to_path_idx.push_back(i);
+		if (paths[i].has_meta) continue;
+		reqs.push_back((meta_req_t) {
+			.idx = i,
+			.ino = paths[i].ino,
+			.name = paths[i].str,
+		});
 	}
+
+	meta_pending = reqs.size();
+	if (meta_pending == 0) return true;
+
+	std::lock_guard<std::mutex> lock(scan_mtx);
+	scan_chunks.clear();
+	scan_requested = true;
+	scan_req_dir = curr_dir;
+	scan_req_gen = dir_gen;
+	scan_req_names = curr_names;
+	scan_req_meta = std::move(reqs);
+	scan_cv.notify_one();
+	return true;
 }
 
-INLINE static int rm_file_callback(const char *file_path,
-																	 const struct stat *,
-																	 int,
-																	 struct FTW *)
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR)
+#define WATCH_BUF_SIZE (64*1024)
+
+// inotify watch on `curr_dir`, only touched by the main thread
+static int watch_fd = -1;
+static int watch_wd = -1;
+static int watch_dir_fd = -1;
+
+// Name -> `paths` index, rebuilt lazily when events come in after the listing has changed
+static std::unordered_map<std::string, size_t> name_index = {};
+static bool name_index_dirty = true;
+
+static void watch_dir(void)
 {
-	if (remove(file_path) < 0) {
-		perror("remove");
-		return -1;
+	if (watch_fd == -1) {
+		watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (watch_fd == -1) {
+			eprintf("could not initialize inotify: %s\n", strerror(errno));
+			return;
+		}
 	}
-	return 0;
+
+	if (watch_wd != -1) inotify_rm_watch(watch_fd, watch_wd);
+	if (watch_dir_fd != -1) close(watch_dir_fd);
+
+	watch_wd = inotify_add_watch(watch_fd, curr_dir, WATCH_MASK);
+	if (watch_wd == -1) {
+		eprintf("could not watch %s: %s\n", curr_dir, strerror(errno));
+	}
+
+	watch_dir_fd = open(curr_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	name_index_dirty = true;
 }
 
-INLINE static void draw_bot_window(Color bg, int th, int ts)
+// Show `curr_dir`, from the cache if possible
+static void load_dir(void)
 {
-	const int		w = GetScreenWidth();
-	const int		h = GetScreenHeight();
-	const int		rw = w;
-	const int		rh = th + ts*2;
-	const int		rx = 0;
-	const int		ry = h - rh;
-	const Color rc = bg;
-	DrawRectangle(rx, ry, rw, rh, rc);
+	// Watch before looking at the directory, so that nothing slips in between
+	watch_dir();
+
+	curr_dir_info_valid = stat(curr_dir, &curr_dir_info) == 0;
+	if (curr_dir_info_valid && restore_dir_snapshot()) return;
+	read_dir();
 }
 
-INLINE static Vector2 get_text_pos_to_draw_into_bot_window(int ts, int th)
+INLINE static char *intern_name(const char *name)
 {
-	return (Vector2) {(float) ts, (float) (GetScreenHeight() - th)};
+	if (curr_names == nullptr) curr_names = std::make_shared<name_pool_t>();
+	return curr_names->copy(name, strlen(name));
 }
 
-static void handle_enter(char *file_path);
+static long find_path_by_name(const char *name)
+{
+	if (name_index_dirty || name_index.size() > paths.size()) {
+		name_index.clear();
+		for (size_t i = 0; i < paths.size(); ++i) {
+			if (paths[i].deleted || paths[i].abs) continue;
+			name_index[paths[i].str] = i;
+		}
+		name_index_dirty = false;
+	}
 
-INLINE static char *scratch_buffer_append_full_file_path(char *file_path)
+	const auto it = name_index.find(name);
+	if (it == name_index.end()) return -1;
+
+	const size_t idx = it->second;
+	if (idx >= paths.size() || paths[idx].deleted || !streq(paths[idx].str, name)) return -1;
+	return idx;
+}
+
+static void release_preview(img_value_t *value);
+
+// Drop the decoded preview of a file that has changed, so the loader picks it up again
+static void invalidate_preview(size_t ino)
 {
-	scratch_buffer_clear();
-	scratch_buffer_append(curr_dir);
-	scratch_buffer_append_char('/');
-	scratch_buffer_append(file_path);
-	return scratch_buffer.str;
+	std::lock_guard<std::mutex> lock(img_map_mtx);
+
+	img_map_t *p = hmgetp_null(img_map, ino);
+	if (p == NULL || p->value.is_placeholder) return;
+
+	release_preview(&p->value);
+	p->value = placeholder_img;
+	wake_loader();
 }
 
-INLINE static void check_for_updated_tile_idx(int *tile_idx, size_t *ino)
+// Drop the img map entry of an inode that's gone, like the one an atomic save renamed a new file over
+static void forget_preview(size_t ino)
 {
-	int new_idx = (int) get_tile_idx_from_tile_pos(selected_tile_pos);
-	size_t new_ino = paths[new_idx].ino;
-	if (*tile_idx == -1) {
-		*ino = new_ino;
-		*tile_idx = new_idx;
-	}
+	std::lock_guard<std::mutex> lock(img_map_mtx);
+
+	img_map_t *p = hmgetp_null(img_map, ino);
+	if (p == NULL) return;
+
+	release_preview(&p->value);
+	hmdel(img_map, ino);
 }
 
-INLINE static bool mtim_cmp(path_t a, path_t b)
+static void watch_add_entry(const char *name)
 {
-	if (a.mtim.tv_sec == b.mtim.tv_sec) {
-		return a.mtim.tv_nsec > b.mtim.tv_nsec;
+	path_t path = {0};
+	path.type = DT_UNKNOWN;
+	if (watch_dir_fd == -1 || !stat_entry_at(watch_dir_fd, name, &path)) return;
+
+	const long idx = find_path_by_name(name);
+	if (idx != -1) {
+		// Already known, the scan might've picked it up before the event got to us,
+		// or it's a new file under an old name, which is how editors save
+		const size_t old_ino = paths[idx].ino;
+		{
+			std::lock_guard<std::mutex> lock(paths_mtx);
+			paths[idx].ino = path.ino;
+			paths[idx].type = path.type;
+			paths[idx].mtim = path.mtim;
+			paths[idx].size = path.size;
+			paths[idx].has_meta = true;
+		}
+
+		if (path.ino == old_ino) {
+			invalidate_preview(path.ino);
+			return;
+		}
+
+		forget_preview(old_ino);
+		fill_img_map_of(paths, idx, idx + 1, false);
+		wake_loader();
+		return;
 	}
-	return a.mtim.tv_sec > b.mtim.tv_sec;
+
+	path.str = intern_name(name);
+	path.has_meta = true;
+
+	const size_t from = paths.size();
+	{
+		std::lock_guard<std::mutex> lock(paths_mtx);
+		paths.emplace_back(path);
+	}
+
+	name_index[path.str] = from;
+	scan_total++;
+
+	invalidate_preview(path.ino);
+	fill_img_map(from, false);
+	wake_loader();
 }
 
-INLINE static bool size_cmp(path_t a, path_t b)
+static void watch_remove_entry(const char *name)
 {
-  return a.size > b.size;
+	const long idx = find_path_by_name(name);
+	if (idx == -1) return;
+	{
+		std::lock_guard<std::mutex> lock(paths_mtx);
+		paths[idx].deleted = true;
+	}
+	name_index.erase(name);
 }
 
-static void handle_keyboard_input(void)
+static void watch_modify_entry(const char *name)
 {
-	const int tpr = get_tiles_per_row();
-	if (tpr == 0) return;
+	const long idx = find_path_by_name(name);
+	if (idx == -1) {
+		watch_add_entry(name);
+		return;
+	}
 
-	int key = GetKeyPressed();
-	if (delete_mode) {
-		if (key == KEY_ESCAPE) {
-			stop_delete_mode();
-			return;
+	path_t *path = &paths[idx];
+	if (watch_dir_fd != -1) {
+		path_t info = *path;
+		if (stat_entry_at(watch_dir_fd, name, &info)) {
+			std::lock_guard<std::mutex> lock(paths_mtx);
+			path->mtim = info.mtim;
+			path->size = info.size;
+			path->has_meta = true;
 		}
+	}
 
-		check_for_updated_tile_idx(&delete_tile_idx, &delete_ino);
+	invalidate_preview(path->ino);
+}
 
-		char *file_path = paths[delete_tile_idx].str;
+INLINE static size_t read_watch_events(char *buf, size_t len)
+{
+	const ssize_t n = read(watch_fd, buf, len);
+	return n > 0 ? (size_t) n : 0;
+}
 
-		scratch_buffer_clear();
-		if (delete_sure) {
-			if (delete_failed) {
-				scratch_buffer_printf("failed to delete %s: %s\n", file_path, delete_fail);
-			} else {
-				scratch_buffer_printf("delete %s recursively? [y/n]", file_path);
-			}
-		} else {
-			scratch_buffer_printf("delete %s? [y/n]", file_path);
-		}
+// Apply what other processes did to `curr_dir` as small deltas to `paths` and `img_map`, runs every frame
+static void poll_dir_watch(void)
+{
+	// Events that come in during a scan stay queued in the kernel until the listing is complete
+	if (watch_fd == -1 || watch_wd == -1 || scanning) return;
 
-		char *text = scratch_buffer_to_string();
+	alignas(struct inotify_event) static char buf[WATCH_BUF_SIZE];
 
-		draw_ask_window(DELETE_SURE_WINDOW_BACKGROUND_COLOR,
-										RAYWHITE,
-										DELETE_ASK_WINDOW_TEXT_PADDING,
-										text);
+	size_t n = read_watch_events(buf, sizeof(buf));
+	if (n == 0) return;
 
-		if (key == KEY_Y) {
-			if (delete_failed) {
-				stop_delete_mode();
-				return;
-			}
+	// Taken before draining the queue: whatever changes after this shows up either
+	// as an event or as a newer mtime, so a cached snapshot never ends up stale
+	struct stat info = {};
+	const bool info_valid = watch_dir_fd != -1 && fstat(watch_dir_fd, &info) == 0;
 
-			if (delete_sure) {
-				nftw(paths[delete_tile_idx].str,
-						 rm_file_callback,
-						 10,
-						 FTW_DEPTH | FTW_MOUNT|FTW_PHYS);
+	uint32_t moved_from_cookie = 0;
+	std::string moved_from_name = {};
 
-				paths[delete_tile_idx].deleted = true;
-				stop_delete_mode();
-				return;
-			} else if (paths[delete_tile_idx].type == DT_DIR) {
-				delete_sure = true;
+	while (n > 0) {
+		for (size_t off = 0; off < n;) {
+			const struct inotify_event *e = (struct inotify_event *) (buf + off);
+			off += sizeof(struct inotify_event) + e->len;
+
+			if (e->mask & IN_Q_OVERFLOW) {
+				// Lost track of things, only a full rescan can help
+				{
+					std::lock_guard<std::mutex> lock(paths_mtx);
+					paths.clear();
+				}
+				read_dir();
+				name_index_dirty = true;
 				return;
 			}
 
-			scratch_buffer_append_full_file_path(get_top_file_path(paths[delete_tile_idx].str));
+			if (e->wd != watch_wd || e->len == 0) continue;
 
-			errno = 0;
-			char *file_path = scratch_buffer_to_string();
-			if (remove(file_path) == -1) {
-				delete_failed = true;
-				delete_fail = strerror(errno);
-				eprintf("failed to delete %s: %s\n", file_path, delete_fail);
-				return;
+			if (!moved_from_name.empty() && !((e->mask & IN_MOVED_TO) && e->cookie == moved_from_cookie)) {
+				// Moved somewhere we don't watch
+				watch_remove_entry(moved_from_name.c_str());
+				moved_from_name.clear();
 			}
 
-			paths[delete_tile_idx].deleted = true;
-			stop_delete_mode();
-		} else if (key == KEY_N) {
-			stop_delete_mode();
+			if (e->mask & IN_MOVED_FROM) {
+				moved_from_cookie = e->cookie;
+				moved_from_name = e->name;
+			} else if (e->mask & IN_MOVED_TO) {
+				const long idx = moved_from_name.empty() ? -1 : find_path_by_name(moved_from_name.c_str());
+				if (idx != -1 && find_path_by_name(e->name) == -1) {
+					// A rename within the directory, the entry keeps its inode and preview
+					char *str = intern_name(e->name);
+					{
+						std::lock_guard<std::mutex> lock(paths_mtx);
+						paths[idx].str = str;
+					}
+					name_index.erase(moved_from_name);
+					name_index[str] = idx;
+				} else {
+					if (idx != -1) watch_remove_entry(moved_from_name.c_str());
+					watch_add_entry(e->name);
+				}
+				moved_from_name.clear();
+			} else if (e->mask & IN_CREATE) {
+				watch_add_entry(e->name);
+			} else if (e->mask & IN_DELETE) {
+				watch_remove_entry(e->name);
+			} else if (e->mask & IN_CLOSE_WRITE) {
+				watch_modify_entry(e->name);
+			}
 		}
 
+		n = read_watch_events(buf, sizeof(buf));
+	}
+
+	if (!moved_from_name.empty()) watch_remove_entry(moved_from_name.c_str());
+
+	if (info_valid) curr_dir_info = info;
+}
+
+typedef struct {
+	size_t ino;
+	std::string file_path;
+} prefetch_preview_t;
+
+typedef struct {
+	size_t gen;
+	std::string dir;
+	dir_snapshot_t snapshot;
+} prefetch_result_t;
+
+// Communication with the prefetcher thread, guarded by `prefetch_mtx`
+static std::mutex prefetch_mtx;
+static std::condition_variable prefetch_cv;
+static bool prefetch_requested = false;
+static std::string prefetch_req_dir = {};
+static size_t prefetch_req_gen = 0;
+static std::vector<prefetch_result_t> prefetch_results = {};
+
+// Bumped to cancel whatever the prefetcher is doing
+static std::atomic<size_t> prefetch_gen = {0};
+
+// Previews of the first screenful of a prefetched directory, the loader gets to them when it's
+// done with the current directory, guarded by `paths_mtx`
+static std::vector<prefetch_preview_t> prefetch_to_load = {};
+
+// Where the selection rests, only touched by the main thread
+static size_t prefetch_sel_idx = -1;
+static size_t prefetch_sel_dir_gen = 0;
+static double prefetch_sel_time = 0.0;
+static bool prefetch_started = false;
+
+static void cancel_prefetch(void)
+{
+	prefetch_gen++;
+	prefetch_started = false;
+
+	std::lock_guard<std::mutex> lock(paths_mtx);
+	prefetch_to_load.clear();
+}
+
+// Lists `dir` into a snapshot which ends up in the dir cache, runs on the prefetcher thread
+static void prefetch_dir(const char *dir, size_t gen)
+{
+	static const bool lazy = getenv_flag(LAZY_METADATA_ENV, true);
+	static const size_t max_entries = getenv_size(PREFETCH_MAX_ENTRIES_ENV, DEFAULT_PREFETCH_MAX_ENTRIES);
+
+	const int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd == -1) return;
+
+	// Taken before listing, same as `curr_dir_info`
+	struct stat info = {};
+	if (fstat(dir_fd, &info) == -1) {
+		close(dir_fd);
 		return;
 	}
 
-	if (rename_mode) {
-		if (key == KEY_ESCAPE) {
-			stop_rename_mode();
-			return;
+	auto names = std::make_shared<name_pool_t>();
+	std::vector<path_t> entries = {};
+	char *batch = (char *) malloc(SCAN_BATCH_SIZE);
+	bool complete = false;
+
+	while (prefetch_gen == gen && !stop_flag && entries.size() <= max_entries) {
+		const long n = syscall(SYS_getdents64, dir_fd, batch, SCAN_BATCH_SIZE);
+		if (n == -1) break;
+		if (n == 0) {
+			complete = true;
+			break;
 		}
 
-		if (rename_sure) {
-			scratch_buffer_clear();
-			if (rename_failed) {
-				scratch_buffer_printf("failed to rename %s to %s, %s. ok?",
-															paths[rename_tile_idx].str,
-															rename_string,
-															rename_fail);
-			} else {
-				scratch_buffer_printf("%s -> %s? [y/n]",
-															paths[rename_tile_idx].str,
-															rename_string);
-			}
+		for (long off = 0; off < n;) {
+			const linux_dirent64_t *e = (linux_dirent64_t *) (batch + off);
+			off += e->d_reclen;
+
+			if (streq(e->d_name, ".")) continue;
+
+			path_t path = {
+				.str = names->copy(e->d_name, strlen(e->d_name)),
+				.ino = (size_t) e->d_ino,
+				.mtim = {0},
+				.size = 0,
+				.type = e->d_type,
+				.abs = false,
+				.deleted = false,
+				.has_meta = !lazy,
+			};
+
+			if (!lazy) stat_entry_at(dir_fd, e->d_name, &path);
+			entries.emplace_back(path);
+		}
+	}
 
-			draw_ask_window(RENAME_SURE_WINDOW_BACKGROUND_COLOR,
-											RAYWHITE,
-											RENAME_ASK_WINDOW_TEXT_PADDING,
-											scratch_buffer_to_string());
+	free(batch);
+	close(dir_fd);
+
+	if (!complete || entries.size() > max_entries || prefetch_gen != gen) return;
+
+	const size_t bytes = get_snapshot_bytes(entries.size(), names.get());
+	prefetch_result_t result = {
+		.gen = gen,
+		.dir = dir,
+		.snapshot = {
+			.dev = info.st_dev,
+			.ino = info.st_ino,
+			.mtim = info.st_mtim,
+			.ctim = info.st_ctim,
+			.paths = std::move(entries),
+			.names = std::move(names),
+			.scroll_offset_y = 0.0f,
+			.selected_tile_pos = {0},
+			.bytes = bytes,
+		},
+	};
 
-			if (key == KEY_Y) {
-				if (rename_failed) {
-					stop_rename_mode();
-					return;
-				}
+	std::lock_guard<std::mutex> lock(prefetch_mtx);
+	prefetch_results.push_back(std::move(result));
+}
 
-				scratch_buffer_append_full_file_path(paths[rename_tile_idx].str);
-				char *old = scratch_buffer_copy();
+// The prefetcher thread
+static void prefetch_dirs(void)
+{
+	setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), PREFETCH_NICE);
 
-				scratch_buffer_append_full_file_path(rename_string);
-				char *new_ = scratch_buffer_copy();
-				const size_t len = scratch_buffer.len;
+	std::unique_lock<std::mutex> lock(prefetch_mtx);
+	while (true) {
+		prefetch_cv.wait(lock, [] { return stop_flag || prefetch_requested; });
+		if (stop_flag) break;
 
-				errno = 0;
-				if (rename(old, new_) != 0) {
-					rename_failed = true;
-					rename_fail = strerror(errno);
+		prefetch_requested = false;
+		const std::string dir = prefetch_req_dir;
+		const size_t gen = prefetch_req_gen;
+		lock.unlock();
 
-					eprintf("failed to rename %s to %s: %s", old, new_, rename_fail);
-					return;
-				}
+		prefetch_dir(dir.c_str(), gen);
 
-				memcpy(paths[rename_tile_idx].str,
-							 get_top_file_path(new_),
-							 len);
+		lock.lock();
+	}
+}
 
-				stop_rename_mode();
-				return;
-			}
+INLINE static size_t get_tile_idx_from_tile_pos(Vector2i pos);
 
-			return;
-		}
+// When the selection rests on a directory for a moment, list it in the background,
+// so that entering it is just a cache hit. Runs on the main thread every frame
+static void poll_prefetch(void)
+{
+	std::vector<prefetch_result_t> results = {};
+	{
+		std::lock_guard<std::mutex> lock(prefetch_mtx);
+		results.swap(prefetch_results);
+	}
 
-		check_for_updated_tile_idx(&rename_tile_idx, &rename_ino);
+	for (auto &result: results) {
+		if (result.gen != prefetch_gen) continue;
 
-		draw_bot_window(DEFAULT_BOT_WINDOW_BACKGROUND_COLOR,
-										RENAME_TEXT_HEIGHT,
-										RENAME_TEXT_SPACING);
+		// Decode the previews of the first screenful too, below everything of the current directory
+		const std::vector<path_t> &entries = result.snapshot.paths;
+		const size_t count = std::min(entries.size(), (size_t) (get_tiles_per_row()*(get_tiles_per_col() + 1)));
 
-		const Vector2 tp = get_text_pos_to_draw_into_bot_window(
-			RENAME_TEXT_SPACING,
-			RENAME_TEXT_HEIGHT);
+		fill_img_map_of(entries, 0, count, true);
 
-		if (rename_string_size > 0) {
-			DrawTextEx(font,
-								 rename_string,
-								 tp,
-								 font_size,
-								 text_spacing,
-								 RAYWHITE);
+		{
+			std::lock_guard<std::mutex> lock(paths_mtx);
+			for (size_t i = 0; i < count; ++i) {
+				if (entries[i].type != DT_REG) continue;
+				prefetch_to_load.push_back((prefetch_preview_t) {
+					.ino = entries[i].ino,
+					.file_path = result.dir + "/" + entries[i].str,
+				});
+			}
 		}
 
-		if (key == KEY_ENTER && rename_string_size >= 1) {
-			rename_sure = true;
-		} else if (key == KEY_SPACE || key_is_printable(key)) {
-			if (rename_string_size == MAX_PATH_SIZE) return;
-			if (!IsKeyDown(KEY_LEFT_SHIFT)) {
-				key = tolower(key);
+		cache_dir_snapshot(std::move(result.snapshot));
+
+		if (count > 0) {
+			{
+				std::lock_guard<std::mutex> lock(loader_mtx);
+				loader_prefetch_ready = true;
 			}
-			rename_string[rename_string_size++] = key;
-		} else if (key == KEY_BACKSPACE) {
-			rename_string[--rename_string_size] = '\0';
+			loader_cv.notify_one();
 		}
+	}
 
+	const size_t idx = get_tile_idx_from_tile_pos(selected_tile_pos);
+	if (idx != prefetch_sel_idx || dir_gen != prefetch_sel_dir_gen) {
+		if (prefetch_started) cancel_prefetch();
+		prefetch_sel_idx = idx;
+		prefetch_sel_dir_gen = dir_gen;
+		prefetch_sel_time = GetTime();
 		return;
 	}
 
-	if (search_mode) {
-		draw_bot_window(DEFAULT_BOT_WINDOW_BACKGROUND_COLOR,
-										SEARCH_TEXT_HEIGHT,
-										SEARCH_TEXT_SPACING);
+	if (prefetch_started || scanning || GetTime() - prefetch_sel_time < PREFETCH_DELAY) return;
+	prefetch_started = true;
 
-		const Vector2 tp = get_text_pos_to_draw_into_bot_window(
-			SEARCH_TEXT_SPACING,
-			SEARCH_TEXT_HEIGHT);
+	if (idx >= paths.size()) return;
 
-		if (typing_search) goto draw_search;
+	const path_t *path = &paths[idx];
+	if (path->type != DT_DIR || path->deleted || path->abs || streq(path->str, "..")) return;
 
-		scratch_buffer_clear();
-		scratch_buffer_printf("%d/%d match",
-													last_matched_idx,
-													matched_idxs.size());
+	std::string dir = curr_dir;
+	dir += "/";
+	dir += path->str;
 
-		DrawTextEx(font,
-							 scratch_buffer_to_string(),
-							 tp,
-							 font_size,
-							 text_spacing,
-							 RAYWHITE);
+	struct stat info = {};
+	if (stat(dir.c_str(), &info) == -1 || find_dir_snapshot(&info)) return;
 
-		if (key == KEY_ESCAPE || key == KEY_ENTER) {
-			stop_search_mode();
-			return;
-		} else if (key == KEY_N) {
-			if (last_matched_idx >= matched_idxs.size()) return;
+	std::lock_guard<std::mutex> lock(prefetch_mtx);
+	prefetch_requested = true;
+	prefetch_req_dir = std::move(dir);
+	prefetch_req_gen = ++prefetch_gen;
+	prefetch_cv.notify_one();
+}
 
-			const size_t idx = matched_idxs[last_matched_idx++];
-			const Vector2i new_selected_tile_pos = idx_to_tile_pos(idx);
+// A file with more than one link, counted only by whichever walker of a job comes across it first, like `du` does
+typedef struct {
+	ino_t ino;
+	uint64_t size;
+} dir_link_t;
 
-			selected_tile_pos.x = new_selected_tile_pos.x;
-			selected_tile_pos.y = new_selected_tile_pos.y;
+// What a single directory contributes to the size of its ancestors, without its subdirectories,
+// `bytes` and `files` leave out the files in `links`
+typedef struct {
+	timespec mtim;
+	uint64_t bytes;
+	uint64_t files;
+	std::vector<std::string> subdirs;
+	std::vector<dir_link_t> links;
+} dir_level_t;
+
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+} dir_key_t;
+
+struct dir_key_hash_t {
+	size_t operator()(const dir_key_t &k) const
+	{
+		return std::hash<uint64_t>()((uint64_t) k.ino ^ ((uint64_t) k.dev << 40));
+	}
+};
 
-			update_offset_if_tile_is_not_visible(selected_tile_pos);
-			return;
-		} else if (key == KEY_P) {
-			if (last_matched_idx == 0) return;
+struct dir_key_eq_t {
+	bool operator()(const dir_key_t &a, const dir_key_t &b) const
+	{
+		return a.dev == b.dev && a.ino == b.ino;
+	}
+};
 
-			const size_t idx = matched_idxs[last_matched_idx--];
-			const Vector2i new_selected_tile_pos = idx_to_tile_pos(idx);
+// Levels are keyed by (dev, ino) and only reused while `mtim` matches,
+// so walking a tree again only reads the directories that changed
+static std::unordered_map<dir_key_t, dir_level_t, dir_key_hash_t, dir_key_eq_t> dir_levels = {};
+static size_t dir_levels_bytes = 0;
+static std::mutex dir_levels_mtx;
 
-			selected_tile_pos.x = new_selected_tile_pos.x;
-			selected_tile_pos.y = new_selected_tile_pos.y;
+// One directory tile of the current directory, summed up as the walkers go
+typedef struct {
+	size_t ino;
+	std::atomic<uint64_t> bytes;
+	std::atomic<uint64_t> files;
+	std::atomic<size_t> pending;
+} dir_size_root_t;
+
+typedef struct {
+	size_t gen;
+	dev_t dev;
+	size_t roots_count;
+	std::unique_ptr<dir_size_root_t[]> roots;
+	std::unordered_map<size_t, size_t> root_by_ino;
+	// Inos of the files with more than one link counted so far, everything is on `dev`
+	std::mutex links_mtx;
+	std::unordered_set<ino_t> links;
+} dir_size_job_t;
+
+typedef struct {
+	std::shared_ptr<dir_size_job_t> job;
+	size_t root;
+	std::string path;
+} walk_item_t;
+
+// Every walker has its own deque, it takes from the back of it and steals from the front of the others
+typedef struct {
+	std::mutex mtx;
+	std::deque<walk_item_t> items;
+} walk_queue_t;
+
+static std::unique_ptr<walk_queue_t[]> walk_queues = nullptr;
+static size_t walk_threads_count = 0;
+static std::atomic<size_t> walk_queued = {0};
+static std::atomic<size_t> walk_gen = {0};
+static std::mutex walk_mtx;
+static std::condition_variable walk_cv;
+
+// The job of the current directory, only touched by the main thread
+static std::shared_ptr<dir_size_job_t> dir_size_job = nullptr;
+static size_t dir_size_dir_gen = -1;
+
+INLINE static size_t get_dir_level_bytes(const dir_level_t *level)
+{
+	size_t bytes = sizeof(dir_key_t) + sizeof(dir_level_t);
+	for (const auto &name: level->subdirs) bytes += sizeof(std::string) + name.size() + 1;
+	bytes += level->links.size()*sizeof(dir_link_t);
+	return bytes;
+}
 
-			update_offset_if_tile_is_not_visible(selected_tile_pos);
-			return;
-		}
+static bool find_dir_level(const struct stat *info, dir_level_t *level)
+{
+	std::lock_guard<std::mutex> lock(dir_levels_mtx);
+	auto it = dir_levels.find((dir_key_t) {info->st_dev, info->st_ino});
+	if (it == dir_levels.end() || !timespec_eq(it->second.mtim, info->st_mtim)) return false;
+	*level = it->second;
+	return true;
+}
 
-		if (!typing_search) return;
+static void store_dir_level(const struct stat *info, const dir_level_t *level)
+{
+	static const size_t cap = getenv_size(DIR_SIZE_CACHE_ENV, DEFAULT_DIR_SIZE_CACHE_MB)*MB;
 
-draw_search:
+	const size_t bytes = get_dir_level_bytes(level);
+	std::lock_guard<std::mutex> lock(dir_levels_mtx);
 
-		if (key == KEY_ESCAPE) {
-			stop_search_mode();
-			return;
-		}
+	auto it = dir_levels.find((dir_key_t) {info->st_dev, info->st_ino});
+	if (it != dir_levels.end()) {
+		dir_levels_bytes -= get_dir_level_bytes(&it->second);
+		dir_levels.erase(it);
+	}
 
-		if (search_string_size > 0) {
-			DrawTextEx(font,
-								 search_string,
-								 tp,
-								 font_size,
-								 text_spacing,
-								 RAYWHITE);
-		}
+	// Levels depend on each other only through their names, so starting over is always correct
+	if (dir_levels_bytes + bytes > cap) {
+		dir_levels.clear();
+		dir_levels_bytes = 0;
+	}
 
-		if (key == KEY_ENTER) {
-			typing_search = false;
-			if (search_string_size < 1) return;
+	dir_levels.emplace((dir_key_t) {info->st_dev, info->st_ino}, *level);
+	dir_levels_bytes += bytes;
+}
 
-			str_tolower(search_string);
+// Reads a single directory, subdirectories on another filesystem are left out, same as `du -x`
+static bool read_dir_level(int dir_fd, dev_t dev, size_t gen, char *batch, dir_level_t *level)
+{
+	while (walk_gen == gen && !stop_flag) {
+		const long n = syscall(SYS_getdents64, dir_fd, batch, SCAN_BATCH_SIZE);
+		if (n == -1) return false;
+		if (n == 0) return true;
 
-			for (size_t i = 0; i < paths.size(); ++i) {
-				if (paths[i].deleted) continue;
+		for (long off = 0; off < n;) {
+			const linux_dirent64_t *e = (linux_dirent64_t *) (batch + off);
+			off += e->d_reclen;
 
-				scratch_buffer_clear();
-				scratch_buffer_append(paths[i].str);
+			if (streq(e->d_name, ".") || streq(e->d_name, "..")) continue;
 
-				str_tolower(scratch_buffer.str);
+			struct stat info = {};
+			if (fstatat(dir_fd, e->d_name, &info, AT_SYMLINK_NOFOLLOW) == -1) continue;
 
-				if (strstr(scratch_buffer.str, search_string) != NULL) {
-					if (matched_idxs.empty()) {
-						const Vector2i new_selected_tile_pos = idx_to_tile_pos(i);
-						selected_tile_pos.x = new_selected_tile_pos.x;
-						selected_tile_pos.y = new_selected_tile_pos.y;
-						update_offset_if_tile_is_not_visible(selected_tile_pos);
-					}
-					matched_idxs.emplace_back(i);
-				}
+			if (S_ISDIR(info.st_mode)) {
+				if (info.st_dev == dev) level->subdirs.emplace_back(e->d_name);
+				continue;
 			}
 
-			if (matched_idxs.size() <= 1) {
-				stop_search_mode();
+			if (info.st_nlink > 1) {
+				level->links.push_back((dir_link_t) {info.st_ino, (uint64_t) info.st_size});
+				continue;
 			}
 
-			memset(search_string, 0, search_string_size);
-			search_string_size = 0;
-		} else if (key == KEY_SPACE || key_is_printable(key)) {
-			if (search_string_size == MAX_PATH_SIZE) return;
-			if (!IsKeyDown(KEY_LEFT_SHIFT)) {
-				key = tolower(key);
-			}
-			search_string[search_string_size++] = key;
-		} else if (key == KEY_BACKSPACE) {
-			search_string[--search_string_size] = '\0';
+			level->bytes += info.st_size;
+			level->files++;
 		}
+	}
 
-		return;
+	return false;
+}
+
+INLINE static void push_walk_item(size_t self, walk_item_t &&item)
+{
+	{
+		std::lock_guard<std::mutex> lock(walk_queues[self].mtx);
+		walk_queues[self].items.push_back(std::move(item));
 	}
 
-	if (IsKeyDown(KEY_LEFT_CONTROL)) {
-		const double curr_time = GetTime();
-		if ((curr_time - last_scale_time) < SCALE_THRESHOLD) return;
+	{
+		std::lock_guard<std::mutex> lock(walk_mtx);
+		walk_queued++;
+	}
+	walk_cv.notify_one();
+}
 
-		if (IsKeyPressed(KEY_EQUAL)
-		&& !IsKeyPressed(KEY_MINUS)
-		&& scale < MAX_SCALE)
-		{
-			set_new_scale(scale + SCALE_STEP);
-			last_scale_time = curr_time;
-		} else if (IsKeyPressed(KEY_MINUS)
-					 && !IsKeyPressed(KEY_EQUAL)
-					 && scale > MIN_SCALE)
-		{
-			set_new_scale(scale - SCALE_STEP);
-			last_scale_time = curr_time;
+static bool pop_walk_item(size_t self, walk_item_t *item)
+{
+	for (size_t i = 0; i < walk_threads_count; ++i) {
+		walk_queue_t *q = &walk_queues[(self + i) % walk_threads_count];
+		std::lock_guard<std::mutex> lock(q->mtx);
+		if (q->items.empty()) continue;
+
+		if (i == 0) {
+			*item = std::move(q->items.back());
+			q->items.pop_back();
+		} else {
+			*item = std::move(q->items.front());
+			q->items.pop_front();
 		}
+
+		walk_queued--;
+		return true;
 	}
 
-	if (sort_mode) {
-	  if (key == KEY_ESCAPE) {
-	    stop_sort_mode();
-	  	return;
-	  }
+	return false;
+}
 
-		draw_ask_window(SORT_WINDOW_BACKGROUND_COLOR,
-	                  RAYWHITE,
-									  DELETE_ASK_WINDOW_TEXT_PADDING,
-							      "s: by size of a file, m: by last modification time");
+static void walk_dir(size_t self, walk_item_t *item, char *batch)
+{
+	dir_size_job_t *job = item->job.get();
+	dir_size_root_t *root = &job->roots[item->root];
+
+	const int dir_fd = open(item->path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (dir_fd != -1) {
+		// Taken before reading, a change in the middle only costs a reread next time
+		struct stat info = {};
+		if (fstat(dir_fd, &info) == 0 && info.st_dev == job->dev) {
+			dir_level_t level = {};
+			bool ok = find_dir_level(&info, &level);
+			if (!ok) {
+				level.mtim = info.st_mtim;
+				ok = read_dir_level(dir_fd, job->dev, job->gen, batch, &level);
+				if (ok) store_dir_level(&info, &level);
+			}
 
-		if (key == KEY_S) {
-      std::sort(paths.begin(), paths.end(), size_cmp);
-      stop_sort_mode();
-    } else if (key == KEY_M) {
-      std::sort(paths.begin(), paths.end(), mtim_cmp);
-      stop_sort_mode();
-    }
+			if (ok) {
+				uint64_t link_bytes = 0, link_files = 0;
+				if (!level.links.empty()) {
+					std::lock_guard<std::mutex> lock(job->links_mtx);
+					for (const auto &link: level.links) {
+						if (!job->links.insert(link.ino).second) continue;
+						link_bytes += link.size;
+						link_files++;
+					}
+				}
 
-    return;
-  }
+				root->bytes += level.bytes + link_bytes;
+				root->files += level.files + link_files;
+				root->pending += level.subdirs.size();
 
-	if (IsKeyDown(KEY_LEFT_SHIFT)) {
-		scroll_speed = BOOSTED_SCROLL_SPEED;
-	} else {
-		scroll_speed = DEFAULT_SCROLL_SPEED;
+				for (const auto &name: level.subdirs) {
+					push_walk_item(self, (walk_item_t) {
+						.job = item->job,
+						.root = item->root,
+						.path = item->path + "/" + name,
+					});
+				}
+			}
+		}
+		close(dir_fd);
 	}
 
-	const int tpc = get_tiles_per_col();
-	const int total_tiles = get_tiles_count();
-	const int total_rows = (total_tiles + tpr - 1) / tpr;
-	const int top_visible_tile = scroll_offset_y / (tile_height + tile_spacing);
-	const int tiles_in_last_row = total_tiles % tpr == 0 ? tpr : total_tiles % tpr;
-
-	switch (key) {
-	case KEY_R: {
-		rename_mode = true;
-		return;
-	} break;
-
-	case KEY_SLASH: {
-		search_mode = true;
-		typing_search = true;
-		return;
-	} break;
+	root->pending--;
+}
 
-	case KEY_ENTER: {
-		size_t idx = get_tile_idx_from_tile_pos(selected_tile_pos);
-		char *tmp = join_dir(paths[idx].str);
-		switch (paths[idx].type) {
-		case DT_DIR: {
-			enter_dir(tmp, idx);
-		} break;
+// A walker thread
+static void walk_dirs(size_t self)
+{
+	setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), PREFETCH_NICE);
 
-		case DT_REG: {
-			handle_enter(tmp);
-		} break;
+	char *batch = (char *) malloc(SCAN_BATCH_SIZE);
 
-		default: break;
+	while (!stop_flag) {
+		walk_item_t item = {};
+		if (!pop_walk_item(self, &item)) {
+			std::unique_lock<std::mutex> lock(walk_mtx);
+			walk_cv.wait(lock, [] { return stop_flag || walk_queued > 0; });
+			continue;
 		}
-	} break;
 
-	case KEY_PERIOD: {
-		const double dot_time = GetTime();
-		if ((dot_time - last_dot_time) <= DOUBLE_DOT_THRESHOLD) {
-			size_t idx = selected_tile_pos.x +
-									 selected_tile_pos.y *
-									 tpr;
+		// Leftovers of a directory we're not in anymore
+		if (item.job->gen != walk_gen) continue;
 
-			enter_dir(join_dir(".."), idx);
-			last_dot_time = 0.0;
-		} else {
-			last_dot_time = dot_time;
-		}
+		walk_dir(self, &item, batch);
+	}
 
-		return;
-	} break;
+	free(batch);
+}
 
-	case KEY_W: case KEY_UP:
-	if (selected_tile_pos.y > 0) {
-		selected_tile_pos.y--;
-		const int relative_tile_y = selected_tile_pos.y - top_visible_tile;
-		if (relative_tile_y == -1) {
-			scroll_offset_y -= (float) tile_full_height;
-		}
-	} break;
+static std::vector<std::thread> start_dir_walkers(void)
+{
+	std::vector<std::thread> walkers = {};
+	if (!getenv_flag(DIR_SIZES_ENV, true)) return walkers;
 
-	case KEY_A: case KEY_LEFT:
-	if (selected_tile_pos.x > 0) {
-		selected_tile_pos.x--;
-	} break;
+	const size_t cores = std::max(std::thread::hardware_concurrency(), 1u);
+	walk_threads_count = getenv_size(DIR_SIZE_THREADS_ENV, std::min(cores, (size_t) MAX_DIR_SIZE_THREADS));
+	if (walk_threads_count == 0) return walkers;
 
-	case KEY_S: case KEY_DOWN:
-  if (IsKeyDown(KEY_LEFT_SHIFT)) {
-		sort_mode = true;
-		return;
+	walk_queues = std::make_unique<walk_queue_t[]>(walk_threads_count);
+	for (size_t i = 0; i < walk_threads_count; ++i) {
+		walkers.emplace_back(walk_dirs, i);
 	}
 
-	if (selected_tile_pos.y < total_rows - 1) {
-		if (!(selected_tile_pos.y == total_rows - 2
-		&& selected_tile_pos.x >= tiles_in_last_row))
-		{
-			selected_tile_pos.y++;
-		}
+	return walkers;
+}
 
-		const int relative_tile_y = selected_tile_pos.y - top_visible_tile;
-		if (tpc == relative_tile_y) {
-			scroll_offset_y += (float) tile_full_height;
-		}
-	} break;
+static void cancel_dir_sizes(void)
+{
+	walk_gen++;
+	dir_size_job = nullptr;
+}
 
-	case KEY_D: case KEY_RIGHT:
-	if (IsKeyDown(KEY_LEFT_SHIFT)) {
-		delete_mode = true;
-		return;
+// Once the listing of the current directory is complete, hand its directories over to the walkers
+static void poll_dir_sizes(void)
+{
+	if (walk_threads_count == 0 || scanning || !curr_dir_info_valid || dir_size_dir_gen == dir_gen) return;
+	dir_size_dir_gen = dir_gen;
+
+	auto job = std::make_shared<dir_size_job_t>();
+	job->gen = ++walk_gen;
+	job->dev = curr_dir_info.st_dev;
+
+	std::vector<size_t> idxs = {};
+	for (size_t i = 0; i < paths.size(); ++i) {
+		const path_t *path = &paths[i];
+		if (path->type != DT_DIR || path->deleted || path->abs || streq(path->str, "..")) continue;
+		idxs.push_back(i);
 	}
 
-	if (selected_tile_pos.y == total_rows - 1) {
-		if (selected_tile_pos.x < tiles_in_last_row - 1) {
-			selected_tile_pos.x++;
-		}
-	} else if (selected_tile_pos.x < tpr - 1) {
-		selected_tile_pos.x++;
-	} break;
+	job->roots_count = idxs.size();
+	job->roots = std::make_unique<dir_size_root_t[]>(idxs.size());
+
+	for (size_t r = 0; r < idxs.size(); ++r) {
+		dir_size_root_t *root = &job->roots[r];
+		root->ino = paths[idxs[r]].ino;
+		root->bytes = 0;
+		root->files = 0;
+		root->pending = 1;
+		job->root_by_ino[root->ino] = r;
+	}
+
+	dir_size_job = job;
+
+	for (size_t r = 0; r < idxs.size(); ++r) {
+		std::string path = curr_dir;
+		path += "/";
+		path += paths[idxs[r]].str;
+
+		push_walk_item(r % walk_threads_count, (walk_item_t) {
+			.job = job,
+			.root = r,
+			.path = std::move(path),
+		});
 	}
 }
 
-INLINE static Vector2 get_text_pos(const Vector2 *tile_pos)
+INLINE static const dir_size_root_t *get_dir_size(size_t ino)
 {
-	return (Vector2) {
-		tile_pos->x + text_padding,
-		tile_pos->y + tile_height - font_size - text_padding
-	};
+	if (dir_size_job == nullptr) return NULL;
+	auto it = dir_size_job->root_by_ino.find(ino);
+	return it == dir_size_job->root_by_ino.end() ? NULL : &dir_size_job->roots[it->second];
 }
 
-INLINE static Rectangle get_tile_rect(const Vector2 *tile_pos)
+// Size of the file, or whatever the walkers have summed up so far for a directory
+INLINE static uint64_t get_real_size(const path_t *path)
 {
-	return (Rectangle) {
-		.x = tile_pos->x + text_padding,
-		.y = tile_pos->y + text_padding,
-		.width = (float) tile_width - text_padding*2,
-		.height = (float) tile_height - text_padding
-	};
+	if (path->type != DT_DIR) return path->size;
+	const dir_size_root_t *root = get_dir_size(path->ino);
+	return root == NULL ? 0 : root->bytes.load();
 }
 
-static void handle_mouse_input(void)
+INLINE static void format_size(uint64_t bytes, char *buf, size_t buf_size)
 {
-	const int tpr = get_tiles_per_row();
-	if (tpr == 0) return;
+	static const char *units[] = {"B", "K", "M", "G", "T", "P"};
+
+	double n = (double) bytes;
+	size_t unit = 0;
+	while (n >= 1024.0 && unit + 1 < sizeof(units)/sizeof(*units)) {
+		n /= 1024.0;
+		unit++;
+	}
+
+	if (unit == 0) snprintf(buf, buf_size, "%llu%s", (unsigned long long) bytes, units[unit]);
+	else snprintf(buf, buf_size, "%.1f%s", n, units[unit]);
+}
+
+static void draw_text_truncated(const char *text,
+																Vector2 pos,
+																float max_text_width,
+																Color color);
+
+// Recursive size and file count in the top-left corner of a directory tile, with `...` while it's still being summed up
+static void draw_dir_size(size_t ino, const Vector2 *tile_pos)
+{
+	const dir_size_root_t *root = get_dir_size(ino);
+	if (root == NULL) return;
+
+	char size[32];
+	format_size(root->bytes, size, sizeof(size));
+
+	scratch_buffer_clear();
+	scratch_buffer_printf("%s, %llu files%s",
+												size,
+												(unsigned long long) root->files.load(),
+												root->pending > 0 ? "..." : "");
+
+	const Vector2 pos = {tile_pos->x + text_padding, tile_pos->y + text_padding};
+	draw_text_truncated(scratch_buffer_to_string(), pos, tile_width - 2*text_padding, LIGHTGRAY);
+}
+
+static void draw_scan_status(void)
+{
+	if (!scanning) return;
+
+	scratch_buffer_clear();
+	scratch_buffer_printf("scanning %zu entries...", scan_total);
+	const char *text = scratch_buffer_to_string();
+
+	const Vector2 ts = MeasureTextEx(font, text, font_size, text_spacing);
+	const float pad = SEARCH_TEXT_SPACING;
+	const float rx = GetScreenWidth() - ts.x - pad*2;
+
+	DrawRectangle(rx, 0, ts.x + pad*2, ts.y + pad*2, DEFAULT_BOT_WINDOW_BACKGROUND_COLOR);
+	DrawTextEx(font, text, (Vector2) {rx + pad, pad}, font_size, text_spacing, RAYWHITE);
+}
+
+INLINE static size_t get_tiles_count(void)
+{
+	return paths.size();
+}
+
+INLINE static int get_tiles_per_col(void)
+{
+	return GetScreenHeight() / (tile_height + tile_spacing);
+}
+
+INLINE static int get_tiles_per_row(void)
+{
+	return GetScreenWidth() / (tile_width + tile_spacing);
+}
+
+INLINE static char *join_dir(const char *dir_path)
+{
+	scratch_buffer_clear();
+	scratch_buffer_append(curr_dir);
+	scratch_buffer_append_char('/');
+	scratch_buffer_append(dir_path);
+	return scratch_buffer_copy();
+}
+
+INLINE static void preserve_tile_pos(bool going_up)
+{
+	if (going_up) {
+		scroll_offset_y = last_scroll_offset_y;
+		selected_tile_pos.x = selected_tile_pos_before_entering_dir.x;
+		selected_tile_pos.y = selected_tile_pos_before_entering_dir.y;
+	} else {
+		selected_tile_pos_before_entering_dir.x = selected_tile_pos.x;
+		selected_tile_pos_before_entering_dir.y = selected_tile_pos.y;
+		memset(&selected_tile_pos, 0, sizeof(selected_tile_pos));
+		last_scroll_offset_y = scroll_offset_y;
+		scroll_offset_y = 0.0;
+	}
+}
+
+INLINE static Vector2i idx_to_tile_pos(size_t idx)
+{
+	const size_t tpr = get_tiles_per_row();
+	return (Vector2i) {
+		(int) (idx % tpr),
+		(int) (idx / tpr)
+	};
+}
+
+INLINE static Vector2 get_tile_pos(size_t tile_pos_x, size_t tile_pos_y)
+{
+	return (Vector2) {
+		(float) tile_pos_x*(tile_width + tile_spacing) + tile_spacing,
+		tile_pos_y*(tile_height + tile_spacing) + tile_spacing - scroll_offset_y
+	};
+}
+
+INLINE static char *get_top_file_path(char *src)
+{
+	for (int i = strlen(src) - 1; i >= 0; i--) {
+		if (src[i] == '/') {
+			return src + i + 1;
+		}
+	}
+	return src;
+}
+
+INLINE static char *get_extension(char *src)
+{
+	for (int i = strlen(src) - 1; i >= 0; i--) {
+		if (src[i] == '.') {
+			char *ret = src + i + 1;
+			if (src[i + 1] == '/') ret++;
+			return ret;
+		}
+	}
+	return NULL;
+}
+
+static void refresh_placeholder_imgs(bool init);
+static void cancel_previews(void);
+
+INLINE static void enter_dir(char *dir)
+{
+	// The listing shows up progressively, so whether we're going up has to be decided by the path itself
+	const bool going_up = streq(get_top_file_path(dir), "..");
+
+	poll_dir_watch();
+	save_dir_snapshot();
+	preserve_tile_pos(going_up);
+	cancel_prefetch();
+	cancel_dir_sizes();
+
+	{
+		std::lock_guard<std::mutex> lock(loader_mtx);
+		idle_flag = true;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(paths_mtx);
+		curr_dir = dir;
+		paths.clear();
+		preview_gen++;
+	}
+
+	cancel_previews();
+	refresh_placeholder_imgs(false);
+	load_dir();
+	wake_loader();
+}
+
+INLINE static void stop_rename_mode(void)
+{
+	rename_mode = false;
+	rename_failed = false;
+	rename_fail = NULL;
+	rename_sure = false;
+	memset(rename_string, 0, rename_string_size);
+	rename_string_size = 0;
+	rename_ino = -1;
+	rename_tile_idx = -1;
+}
+
+INLINE static void stop_sort_mode(void)
+{
+  sort_mode = false;
+}
+
+INLINE static void stop_search_mode(void)
+{
+	search_mode = false;
+	typing_search = false;
+	matched_idxs.clear();
+	memset(search_string, 0, search_string_size);
+	search_string_size = 0;
+}
+
+INLINE static void stop_delete_mode(void)
+{
+	delete_mode = false;
+	delete_failed = false;
+	delete_fail = NULL;
+	delete_sure = false;
+	delete_ino = -1;
+	delete_tile_idx = -1;
+}
+
+INLINE static void str_tolower(char *str)
+{
+	for (char *p = str; p != NULL && *p != '\0'; p++, *p = tolower(*p));
+}
+
+INLINE static size_t get_tile_idx_from_tile_pos(Vector2i pos)
+{
+	return pos.x + pos.y*get_tiles_per_row();
+}
+
+INLINE static void draw_text_boxed(Font font,
+																	 const char *text,
+																	 Rectangle rec,
+																	 bool word_wrap,
+																	 Color tint);
+
+static void draw_ask_window(Color bg, Color tc, int pad, char *text)
+{
+	const int w = GetScreenWidth();
+	const int h = GetScreenHeight();
+
+	const int rw = w / 3;
+	const int rh = h / 6;
+	const int rx = (w - rw) / 2;
+	const int ry = (h - rh) / 2;
+
+	DrawRectangle(rx, ry, rw, rh, bg);
+
+	const Vector2 ts = MeasureTextEx(font, text, font_size, text_spacing);
+	const Vector2 tp = {
+		rx + (rw - ts.x) / 2,
+		ry + (rh - ts.y) / 2
+	};
+
+	if (ts.x < rw - 2*pad) {
+		draw_text_truncated(text, tp, rw, tc);
+	} else {
+		draw_text_boxed(font, text,
+										(Rectangle) {
+											(float) (rx + pad),
+											(float) (ry + pad),
+											(float) (rw - pad),
+											(float) (rh - pad)
+										}, true, tc);
+	}
+}
+
+INLINE static int rm_file_callback(const char *file_path,
+																	 const struct stat *,
+																	 int,
+																	 struct FTW *)
+{
+	if (remove(file_path) < 0) {
+		perror("remove");
+		return -1;
+	}
+	return 0;
+}
+
+INLINE static void draw_bot_window(Color bg, int th, int ts)
+{
+	const int		w = GetScreenWidth();
+	const int		h = GetScreenHeight();
+	const int		rw = w;
+	const int		rh = th + ts*2;
+	const int		rx = 0;
+	const int		ry = h - rh;
+	const Color rc = bg;
+	DrawRectangle(rx, ry, rw, rh, rc);
+}
+
+INLINE static Vector2 get_text_pos_to_draw_into_bot_window(int ts, int th)
+{
+	return (Vector2) {(float) ts, (float) (GetScreenHeight() - th)};
+}
+
+static void handle_enter(char *file_path);
+
+INLINE static char *scratch_buffer_append_full_file_path(char *file_path)
+{
+	scratch_buffer_clear();
+	scratch_buffer_append(curr_dir);
+	scratch_buffer_append_char('/');
+	scratch_buffer_append(file_path);
+	return scratch_buffer.str;
+}
+
+INLINE static void check_for_updated_tile_idx(int *tile_idx, size_t *ino)
+{
+	int new_idx = (int) get_tile_idx_from_tile_pos(selected_tile_pos);
+	size_t new_ino = paths[new_idx].ino;
+	if (*tile_idx == -1) {
+		*ino = new_ino;
+		*tile_idx = new_idx;
+	}
+}
+
+INLINE static bool mtim_cmp(path_t a, path_t b)
+{
+	if (a.mtim.tv_sec == b.mtim.tv_sec) {
+		return a.mtim.tv_nsec > b.mtim.tv_nsec;
+	}
+	return a.mtim.tv_sec > b.mtim.tv_sec;
+}
+
+INLINE static bool size_cmp(path_t a, path_t b)
+{
+  return a.size > b.size;
+}
+
+// The walkers keep adding up while we sort, so the sizes are taken once up front
+static void sort_by_real_size(void)
+{
+	std::vector<std::pair<uint64_t, path_t>> sized = {};
+	sized.reserve(paths.size());
+	for (const auto &path: paths) sized.emplace_back(get_real_size(&path), path);
+
+	std::sort(sized.begin(), sized.end(), [](const auto &a, const auto &b) { return a.first > b.first; });
+
+	for (size_t i = 0; i < sized.size(); ++i) paths[i] = sized[i].second;
+}
+
+static void handle_keyboard_input(void)
+{
+	const int tpr = get_tiles_per_row();
+	if (tpr == 0) return;
+
+	int key = GetKeyPressed();
+	if (delete_mode) {
+		if (key == KEY_ESCAPE) {
+			stop_delete_mode();
+			return;
+		}
+
+		check_for_updated_tile_idx(&delete_tile_idx, &delete_ino);
+
+		char *file_path = paths[delete_tile_idx].str;
+
+		scratch_buffer_clear();
+		if (delete_sure) {
+			if (delete_failed) {
+				scratch_buffer_printf("failed to delete %s: %s\n", file_path, delete_fail);
+			} else {
+				scratch_buffer_printf("delete %s recursively? [y/n]", file_path);
+			}
+		} else {
+			scratch_buffer_printf("delete %s? [y/n]", file_path);
+		}
+
+		char *text = scratch_buffer_to_string();
+
+		draw_ask_window(DELETE_SURE_WINDOW_BACKGROUND_COLOR,
+										RAYWHITE,
+										DELETE_ASK_WINDOW_TEXT_PADDING,
+										text);
+
+		if (key == KEY_Y) {
+			if (delete_failed) {
+				stop_delete_mode();
+				return;
+			}
+
+			if (delete_sure) {
+				nftw(paths[delete_tile_idx].str,
+						 rm_file_callback,
+						 10,
+						 FTW_DEPTH | FTW_MOUNT|FTW_PHYS);
+
+				paths[delete_tile_idx].deleted = true;
+				stop_delete_mode();
+				return;
+			} else if (paths[delete_tile_idx].type == DT_DIR) {
+				delete_sure = true;
+				return;
+			}
+
+			scratch_buffer_append_full_file_path(get_top_file_path(paths[delete_tile_idx].str));
+
+			errno = 0;
+			char *file_path = scratch_buffer_to_string();
+			if (remove(file_path) == -1) {
+				delete_failed = true;
+				delete_fail = strerror(errno);
+				eprintf("failed to delete %s: %s\n", file_path, delete_fail);
+				return;
+			}
+
+			paths[delete_tile_idx].deleted = true;
+			stop_delete_mode();
+		} else if (key == KEY_N) {
+			stop_delete_mode();
+		}
+
+		return;
+	}
+
+	if (rename_mode) {
+		if (key == KEY_ESCAPE) {
+			stop_rename_mode();
+			return;
+		}
+
+		if (rename_sure) {
+			scratch_buffer_clear();
+			if (rename_failed) {
+				scratch_buffer_printf("failed to rename %s to %s, %s. ok?",
+															paths[rename_tile_idx].str,
+															rename_string,
+															rename_fail);
+			} else {
+				scratch_buffer_printf("%s -> %s? [y/n]",
+															paths[rename_tile_idx].str,
+															rename_string);
+			}
+
+			draw_ask_window(RENAME_SURE_WINDOW_BACKGROUND_COLOR,
+											RAYWHITE,
+											RENAME_ASK_WINDOW_TEXT_PADDING,
+											scratch_buffer_to_string());
+
+			if (key == KEY_Y) {
+				if (rename_failed) {
+					stop_rename_mode();
+					return;
+				}
+
+				scratch_buffer_append_full_file_path(paths[rename_tile_idx].str);
+				char *old = scratch_buffer_copy();
+
+				scratch_buffer_append_full_file_path(rename_string);
+				char *new_ = scratch_buffer_copy();
+
+				errno = 0;
+				if (rename(old, new_) != 0) {
+					rename_failed = true;
+					rename_fail = strerror(errno);
+
+					eprintf("failed to rename %s to %s: %s", old, new_, rename_fail);
+					return;
+				}
+
+				// The old name lives in a pool packed with other names, so it can't be overwritten in place
+				char *new_top = get_top_file_path(new_);
+				char *new_str = str_copy(new_top, strlen(new_top));
+				{
+					std::lock_guard<std::mutex> lock(paths_mtx);
+					paths[rename_tile_idx].str = new_str;
+				}
+				name_index_dirty = true;
+
+				stop_rename_mode();
+				return;
+			}
+
+			return;
+		}
+
+		check_for_updated_tile_idx(&rename_tile_idx, &rename_ino);
+
+		draw_bot_window(DEFAULT_BOT_WINDOW_BACKGROUND_COLOR,
+										RENAME_TEXT_HEIGHT,
+										RENAME_TEXT_SPACING);
+
+		const Vector2 tp = get_text_pos_to_draw_into_bot_window(
+			RENAME_TEXT_SPACING,
+			RENAME_TEXT_HEIGHT);
+
+		if (rename_string_size > 0) {
+			DrawTextEx(font,
+								 rename_string,
+								 tp,
+								 font_size,
+								 text_spacing,
+								 RAYWHITE);
+		}
+
+		if (key == KEY_ENTER && rename_string_size >= 1) {
+			rename_sure = true;
+		} else if (key == KEY_SPACE || key_is_printable(key)) {
+			if (rename_string_size == MAX_PATH_SIZE) return;
+			if (!IsKeyDown(KEY_LEFT_SHIFT)) {
+				key = tolower(key);
+			}
+			rename_string[rename_string_size++] = key;
+		} else if (key == KEY_BACKSPACE) {
+			rename_string[--rename_string_size] = '\0';
+		}
+
+		return;
+	}
+
+	if (search_mode) {
+		draw_bot_window(DEFAULT_BOT_WINDOW_BACKGROUND_COLOR,
+										SEARCH_TEXT_HEIGHT,
+										SEARCH_TEXT_SPACING);
+
+		const Vector2 tp = get_text_pos_to_draw_into_bot_window(
+			SEARCH_TEXT_SPACING,
+			SEARCH_TEXT_HEIGHT);
+
+		if (typing_search) goto draw_search;
+
+		scratch_buffer_clear();
+		scratch_buffer_printf("%d/%d match",
+													last_matched_idx,
+													matched_idxs.size());
+
+		DrawTextEx(font,
+							 scratch_buffer_to_string(),
+							 tp,
+							 font_size,
+							 text_spacing,
+							 RAYWHITE);
+
+		if (key == KEY_ESCAPE || key == KEY_ENTER) {
+			stop_search_mode();
+			return;
+		} else if (key == KEY_N) {
+			if (last_matched_idx >= matched_idxs.size()) return;
+
+			const size_t idx = matched_idxs[last_matched_idx++];
+			const Vector2i new_selected_tile_pos = idx_to_tile_pos(idx);
+
+			selected_tile_pos.x = new_selected_tile_pos.x;
+			selected_tile_pos.y = new_selected_tile_pos.y;
+
+			update_offset_if_tile_is_not_visible(selected_tile_pos);
+			return;
+		} else if (key == KEY_P) {
+			if (last_matched_idx == 0) return;
+
+			const size_t idx = matched_idxs[last_matched_idx--];
+			const Vector2i new_selected_tile_pos = idx_to_tile_pos(idx);
+
+			selected_tile_pos.x = new_selected_tile_pos.x;
+			selected_tile_pos.y = new_selected_tile_pos.y;
+
+			update_offset_if_tile_is_not_visible(selected_tile_pos);
+			return;
+		}
+
+		if (!typing_search) return;
+
+draw_search:
+
+		if (key == KEY_ESCAPE) {
+			stop_search_mode();
+			return;
+		}
+
+		if (search_string_size > 0) {
+			DrawTextEx(font,
+								 search_string,
+								 tp,
+								 font_size,
+								 text_spacing,
+								 RAYWHITE);
+		}
+
+		if (key == KEY_ENTER) {
+			typing_search = false;
+			if (search_string_size < 1) return;
+
+			str_tolower(search_string);
+
+			for (size_t i = 0; i < paths.size(); ++i) {
+				if (paths[i].deleted) continue;
+
+				scratch_buffer_clear();
+				scratch_buffer_append(paths[i].str);
+
+				str_tolower(scratch_buffer.str);
+
+				if (strstr(scratch_buffer.str, search_string) != NULL) {
+					if (matched_idxs.empty()) {
+						const Vector2i new_selected_tile_pos = idx_to_tile_pos(i);
+						selected_tile_pos.x = new_selected_tile_pos.x;
+						selected_tile_pos.y = new_selected_tile_pos.y;
+						update_offset_if_tile_is_not_visible(selected_tile_pos);
+					}
+					matched_idxs.emplace_back(i);
+				}
+			}
+
+			if (matched_idxs.size() <= 1) {
+				stop_search_mode();
+			}
+
+			memset(search_string, 0, search_string_size);
+			search_string_size = 0;
+		} else if (key == KEY_SPACE || key_is_printable(key)) {
+			if (search_string_size == MAX_PATH_SIZE) return;
+			if (!IsKeyDown(KEY_LEFT_SHIFT)) {
+				key = tolower(key);
+			}
+			search_string[search_string_size++] = key;
+		} else if (key == KEY_BACKSPACE) {
+			search_string[--search_string_size] = '\0';
+		}
+
+		return;
+	}
+
+	if (IsKeyDown(KEY_LEFT_CONTROL)) {
+		const double curr_time = GetTime();
+		if ((curr_time - last_scale_time) < SCALE_THRESHOLD) return;
+
+		if (IsKeyPressed(KEY_EQUAL)
+		&& !IsKeyPressed(KEY_MINUS)
+		&& scale < MAX_SCALE)
+		{
+			set_new_scale(scale + SCALE_STEP);
+			last_scale_time = curr_time;
+		} else if (IsKeyPressed(KEY_MINUS)
+					 && !IsKeyPressed(KEY_EQUAL)
+					 && scale > MIN_SCALE)
+		{
+			set_new_scale(scale - SCALE_STEP);
+			last_scale_time = curr_time;
+		}
+	}
+
+	if (sort_mode) {
+	  if (key == KEY_ESCAPE) {
+	    stop_sort_mode();
+	  	return;
+	  }
+
+		draw_ask_window(SORT_WINDOW_BACKGROUND_COLOR,
+	                  RAYWHITE,
+									  DELETE_ASK_WINDOW_TEXT_PADDING,
+							      "s: by size of a file, r: by real size, m: by last modification time");
+
+		if (key == KEY_S) {
+      wait_for_metadata();
+      std::lock_guard<std::mutex> lock(paths_mtx);
+      std::sort(paths.begin(), paths.end(), size_cmp);
+      name_index_dirty = true;
+      stop_sort_mode();
+    } else if (key == KEY_R) {
+      wait_for_metadata();
+      std::lock_guard<std::mutex> lock(paths_mtx);
+      sort_by_real_size();
+      name_index_dirty = true;
+      stop_sort_mode();
+    } else if (key == KEY_M) {
+      wait_for_metadata();
+      std::lock_guard<std::mutex> lock(paths_mtx);
+      std::sort(paths.begin(), paths.end(), mtim_cmp);
+      name_index_dirty = true;
+      stop_sort_mode();
+    }
+
+    return;
+  }
+
+	if (IsKeyDown(KEY_LEFT_SHIFT)) {
+		scroll_speed = BOOSTED_SCROLL_SPEED;
+	} else {
+		scroll_speed = DEFAULT_SCROLL_SPEED;
+	}
+
+	const int tpc = get_tiles_per_col();
+	const int total_tiles = get_tiles_count();
+	const int total_rows = (total_tiles + tpr - 1) / tpr;
+	const int top_visible_tile = scroll_offset_y / (tile_height + tile_spacing);
+	const int tiles_in_last_row = total_tiles % tpr == 0 ? tpr : total_tiles % tpr;
+
+	switch (key) {
+	case KEY_R: {
+		rename_mode = true;
+		return;
+	} break;
+
+	case KEY_SLASH: {
+		search_mode = true;
+		typing_search = true;
+		return;
+	} break;
+
+	case KEY_ENTER: {
+		size_t idx = get_tile_idx_from_tile_pos(selected_tile_pos);
+		if (idx >= paths.size()) break;
+		char *tmp = join_dir(paths[idx].str);
+		switch (paths[idx].type) {
+		case DT_DIR: {
+			enter_dir(tmp);
+		} break;
+
+		case DT_REG: {
+			handle_enter(tmp);
+		} break;
+
+		default: break;
+		}
+	} break;
+
+	case KEY_PERIOD: {
+		const double dot_time = GetTime();
+		if ((dot_time - last_dot_time) <= DOUBLE_DOT_THRESHOLD) {
+			enter_dir(join_dir(".."));
+			last_dot_time = 0.0;
+		} else {
+			last_dot_time = dot_time;
+		}
+
+		return;
+	} break;
+
+	case KEY_W: case KEY_UP:
+	if (selected_tile_pos.y > 0) {
+		selected_tile_pos.y--;
+		const int relative_tile_y = selected_tile_pos.y - top_visible_tile;
+		if (relative_tile_y == -1) {
+			scroll_offset_y -= (float) tile_full_height;
+		}
+	} break;
+
+	case KEY_A: case KEY_LEFT:
+	if (selected_tile_pos.x > 0) {
+		selected_tile_pos.x--;
+	} break;
+
+	case KEY_S: case KEY_DOWN:
+  if (IsKeyDown(KEY_LEFT_SHIFT)) {
+		sort_mode = true;
+		return;
+	}
+
+	if (selected_tile_pos.y < total_rows - 1) {
+		if (!(selected_tile_pos.y == total_rows - 2
+		&& selected_tile_pos.x >= tiles_in_last_row))
+		{
+			selected_tile_pos.y++;
+		}
+
+		const int relative_tile_y = selected_tile_pos.y - top_visible_tile;
+		if (tpc == relative_tile_y) {
+			scroll_offset_y += (float) tile_full_height;
+		}
+	} break;
+
+	case KEY_D: case KEY_RIGHT:
+	if (IsKeyDown(KEY_LEFT_SHIFT)) {
+		delete_mode = true;
+		return;
+	}
+
+	if (selected_tile_pos.y == total_rows - 1) {
+		if (selected_tile_pos.x < tiles_in_last_row - 1) {
+			selected_tile_pos.x++;
+		}
+	} else if (selected_tile_pos.x < tpr - 1) {
+		selected_tile_pos.x++;
+	} break;
+	}
+}
+
+INLINE static Vector2 get_text_pos(const Vector2 *tile_pos)
+{
+	return (Vector2) {
+		tile_pos->x + text_padding,
+		tile_pos->y + tile_height - font_size - text_padding
+	};
+}
+
+INLINE static Rectangle get_tile_rect(const Vector2 *tile_pos)
+{
+	return (Rectangle) {
+		.x = tile_pos->x + text_padding,
+		.y = tile_pos->y + text_padding,
+		.width = (float) tile_width - text_padding*2,
+		.height = (float) tile_height - text_padding
+	};
+}
+
+static void handle_mouse_input(void)
+{
+	const int tpr = get_tiles_per_row();
+	if (tpr == 0) return;
 
 	scroll_offset_y -= GetMouseWheelMove()*scroll_speed;
 
-	if (scroll_offset_y < 0) scroll_offset_y = 0;
-	if (!IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) return;
+	if (scroll_offset_y < 0) scroll_offset_y = 0;
+	if (!IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) return;
+
+	const double curr_time = GetTime();
+	Vector2 mouse_pos = GetMousePosition();
+
+	for (size_t i = 0; i < paths.size(); ++i) {
+		if (paths[i].deleted) continue;
+
+		const int tile_pos_x = i % tpr;
+		const int tile_pos_y = i / tpr;
+
+		const Vector2 tile_pos = get_tile_pos(tile_pos_x, tile_pos_y);
+		const Rectangle tile_rect = get_tile_rect(&tile_pos);
+
+		if (!CheckCollisionPointRec(mouse_pos, tile_rect)) continue;
+		if ((curr_time - last_click_time) <= DOUBLE_CLICK_THRESHOLD
+		&& CheckCollisionPointRec(last_click_pos, tile_rect))
+		{
+			char *tmp = join_dir(paths[i].str);
+			switch (paths[i].type) {
+			case DT_DIR: {
+				enter_dir(tmp);
+				last_click_time = 0.0;
+			} break;
+
+			case DT_REG: {
+				handle_enter(tmp);
+			} break;
+
+			default: break;
+			}
+		}
+
+		last_click_pos = mouse_pos;
+		last_click_time = curr_time;
+		selected_tile_pos.x = tile_pos_x;
+		selected_tile_pos.y = tile_pos_y;
+		break;
+	}
+}
+
+static void draw_text_truncated(const char *text,
+																Vector2 pos,
+																float max_text_width,
+																Color color)
+{
+	const float text_width = MeasureTextEx(font, text, font_size, text_spacing).x;
+
+	if (text_width > max_text_width) {
+		int len = strlen(text);
+		char truncated[MAX_PATH_SIZE] = {0};
+		strncpy(truncated, text, sizeof(truncated));
+
+		while (MeasureTextEx(font, truncated, font_size, text_spacing).x +
+					 MeasureTextEx(font, "...", font_size, text_spacing).x > max_text_width
+			&& len > 0)
+		{
+			truncated[--len] = '\0';
+		}
+
+		strcat(truncated, "...");
+		DrawTextEx(font, truncated, pos, font_size, text_spacing, color);
+	} else {
+		DrawTextEx(font, text, pos, font_size, text_spacing, color);
+	}
+}
+
+static void draw_text_boxed_selectable(Font font,
+																			 const char *text,
+																			 Rectangle rec,
+																			 bool word_wrap,
+																			 Color tint,
+																			 int selectStart,
+																			 int selectLength,
+																			 Color selectTint,
+																			 Color selectBackTint)
+{
+	int length = TextLength(text);
+
+	float textOffsetY = 0;
+	float textOffsetX = 0.0f;
+
+	float scaleFactor = font_size / (float) font.baseSize;
+
+	enum { MEASURE_STATE = 0, DRAW_STATE = 1 };
+	int state = word_wrap? MEASURE_STATE : DRAW_STATE;
+
+	int startLine = -1;
+	int endLine = -1;
+	int lastk = -1;
+
+	for (int i = 0, k = 0; i < length; i++, k++) {
+		int codepointByteCount = 0;
+		int codepoint = GetCodepoint(&text[i], &codepointByteCount);
+		int index = GetGlyphIndex(font, codepoint);
+
+		if (codepoint == 0x3f) codepointByteCount = 1;
+		i += (codepointByteCount - 1);
+
+		float glyphWidth = 0;
+		if (codepoint != '\n') {
+			glyphWidth = (font.glyphs[index].advanceX == 0) ?
+				font.recs[index].width*scaleFactor :
+				font.glyphs[index].advanceX*scaleFactor;
+
+			if (i + 1 < length) glyphWidth = glyphWidth + text_spacing;
+		}
+
+		if (state == MEASURE_STATE) {
+			if ((codepoint == ' ') || (codepoint == '\t') || (codepoint == '\n')) endLine = i;
+			if ((textOffsetX + glyphWidth) > rec.width) {
+				endLine = (endLine < 1)? i : endLine;
+				if (i == endLine) endLine -= codepointByteCount;
+				if ((startLine + codepointByteCount) == endLine) endLine = (i - codepointByteCount);
+
+				state = !state;
+			} else if ((i + 1) == length) {
+				endLine = i;
+				state = !state;
+			}
+			else if (codepoint == '\n') state = !state;
+			if (state == DRAW_STATE) {
+				textOffsetX = 0;
+				i = startLine;
+				glyphWidth = 0;
+
+				int tmp = lastk;
+				lastk = k - 1;
+				k = tmp;
+			}
+		}
+		else {
+			if (codepoint == '\n') {
+				if (!word_wrap) {
+					textOffsetY += (font.baseSize + font.baseSize/2)*scaleFactor;
+					textOffsetX = 0;
+				}
+			}
+			else {
+				if (!word_wrap && ((textOffsetX + glyphWidth) > rec.width)) {
+					textOffsetY += (font.baseSize + font.baseSize/2)*scaleFactor;
+					textOffsetX = 0;
+				}
+
+				if ((textOffsetY + font.baseSize*scaleFactor) > rec.height) break;
+
+				bool isGlyphSelected = false;
+				if ((selectStart >= 0)
+				&& (k >= selectStart)
+				&& (k < (selectStart + selectLength)))
+				{
+					DrawRectangleRec((Rectangle) {
+														 rec.x + textOffsetX - 1,
+														 rec.y + textOffsetY,
+														 glyphWidth,
+														 (float)font.baseSize*scaleFactor
+													 },
+													 selectBackTint);
+					isGlyphSelected = true;
+				}
+
+				if ((codepoint != ' ') && (codepoint != '\t')) {
+					DrawTextCodepoint(font, codepoint,
+														(Vector2){rec.x + textOffsetX, rec.y + textOffsetY},
+														font_size,
+														isGlyphSelected? selectTint : tint);
+				}
+			}
+
+			if (word_wrap && (i == endLine)) {
+				textOffsetY += (font.baseSize + font.baseSize/2)*scaleFactor;
+				textOffsetX = 0;
+				startLine = endLine;
+				endLine = -1;
+				glyphWidth = 0;
+				selectStart += lastk - k;
+				k = lastk;
+
+				state = !state;
+			}
+		}
+
+		if ((textOffsetX != 0) || (codepoint != ' ')) textOffsetX += glyphWidth;
+	}
+}
+
+INLINE static void draw_text_boxed(Font font,
+																	 const char *text,
+																	 Rectangle rec,
+																	 bool word_wrap,
+																	 Color tint)
+{
+	draw_text_boxed_selectable(font, text, rec, word_wrap, tint, 0, 0, WHITE, WHITE);
+}
+
+// Area averaging downscaler for 8 bit images of 1 to 4 channels. Every destination pixel is the average of
+// the box of source pixels it covers: the rows of a box are summed into a row of 16 bit sums first, with SIMD
+// where the CPU has it, then each box's columns are summed out of that row
+typedef void (*accumulate_row_t)(uint16_t *acc, const uint8_t *src, size_t n);
+
+static void accumulate_row_scalar(uint16_t *acc, const uint8_t *src, size_t n)
+{
+	for (size_t i = 0; i < n; ++i) acc[i] += src[i];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void accumulate_row_sse2(uint16_t *acc, const uint8_t *src, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+		__m128i *a = (__m128i *) (acc + i);
+		_mm_storeu_si128(a + 0, _mm_add_epi16(_mm_loadu_si128(a + 0), _mm_unpacklo_epi8(v, zero)));
+		_mm_storeu_si128(a + 1, _mm_add_epi16(_mm_loadu_si128(a + 1), _mm_unpackhi_epi8(v, zero)));
+	}
+
+	accumulate_row_scalar(acc + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void accumulate_row_avx2(uint16_t *acc, const uint8_t *src, size_t n)
+{
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i *a = (__m256i *) (acc + i);
+		const __m256i lo = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (src + i)));
+		const __m256i hi = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (src + i + 16)));
+		_mm256_storeu_si256(a + 0, _mm256_add_epi16(_mm256_loadu_si256(a + 0), lo));
+		_mm256_storeu_si256(a + 1, _mm256_add_epi16(_mm256_loadu_si256(a + 1), hi));
+	}
+
+	accumulate_row_scalar(acc + i, src + i, n - i);
+}
+#endif
+
+static accumulate_row_t get_accumulate_row(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return accumulate_row_avx2;
+	if (__builtin_cpu_supports("sse2")) return accumulate_row_sse2;
+#endif
+	return accumulate_row_scalar;
+}
+
+// `swap_rb` swaps the first and third channel on the way, which turns BGR(A) into RGB(A) and back
+static bool box_downscale_with(accumulate_row_t accumulate_row,
+															 const uint8_t *src, int sw, int sh, size_t src_stride, int channels,
+															 uint8_t *dst, int dw, int dh, size_t dst_stride, bool swap_rb)
+{
+	if (channels < 1 || channels > 4 || dw < 1 || dh < 1 || dw > sw || dh > sh) return false;
+
+	const size_t row_size = (size_t) sw*channels;
+	std::vector<uint16_t> acc16(row_size);
+	std::vector<uint32_t> acc(row_size);
+	std::vector<int> xs(dw + 1);
+	for (int x = 0; x <= dw; ++x) xs[x] = (int) ((int64_t) x*sw/dw);
+
+	const int r = swap_rb && channels >= 3 ? 2 : 0;
+	const int b = swap_rb && channels >= 3 ? 0 : 2;
+
+	for (int dy = 0; dy < dh; ++dy) {
+		const int y0 = (int) ((int64_t) dy*sh/dh);
+		const int y1 = (int) ((int64_t) (dy + 1)*sh/dh);
+
+		// 16 bits hold the sum of 257 rows of 255s, taller boxes are summed that many rows at a time
+		std::fill(acc.begin(), acc.end(), 0);
+		for (int y = y0; y < y1;) {
+			const int chunk_end = std::min(y1, y + 257);
+			std::fill(acc16.begin(), acc16.end(), 0);
+			for (; y < chunk_end; ++y) accumulate_row(acc16.data(), src + y*src_stride, row_size);
+			for (size_t i = 0; i < row_size; ++i) acc[i] += acc16[i];
+		}
+
+		uint8_t *out = dst + dy*dst_stride;
+		for (int dx = 0; dx < dw; ++dx) {
+			const int x0 = xs[dx], x1 = xs[dx + 1];
+			const uint32_t count = (uint32_t) (x1 - x0)*(y1 - y0);
+
+			uint32_t sum[4] = {0};
+			for (int x = x0; x < x1; ++x) {
+				const uint32_t *p = &acc[(size_t) x*channels];
+				for (int c = 0; c < channels; ++c) sum[c] += p[c];
+			}
+
+			uint8_t *o = out + (size_t) dx*channels;
+			for (int c = 0; c < channels; ++c) {
+				const int oc = c == 0 ? r : c == 2 ? b : c;
+				o[oc] = (uint8_t) ((sum[c] + count/2)/count);
+			}
+		}
+	}
+
+	return true;
+}
+
+static bool box_downscale(const uint8_t *src, int sw, int sh, size_t src_stride, int channels,
+													uint8_t *dst, int dw, int dh, size_t dst_stride, bool swap_rb)
+{
+	static const accumulate_row_t accumulate_row = get_accumulate_row();
+	return box_downscale_with(accumulate_row, src, sw, sh, src_stride, channels, dst, dw, dh, dst_stride, swap_rb);
+}
+
+// Channels of the pixel formats `box_downscale` takes, 0 for anything else
+INLINE static int get_box_channels(int pixel_format)
+{
+	switch (pixel_format) {
+	case PIXELFORMAT_UNCOMPRESSED_GRAYSCALE:	return 1;
+	case PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA: return 2;
+	case PIXELFORMAT_UNCOMPRESSED_R8G8B8:			return 3;
+	case PIXELFORMAT_UNCOMPRESSED_R8G8B8A8:		return 4;
+	default: return 0;
+	}
+}
+
+// Shrinks a BGR video frame into `dst` as RGB in one pass, OpenCV does whatever that can't,
+// false for frames that are neither gray, BGR nor BGRA, which `cvtColor` would throw on
+static bool convert_frame(const Mat &frame, uint8_t *dst, int w, int h, size_t dst_stride)
+{
+	int code = 0;
+	switch (frame.type()) {
+	case CV_8UC3:
+		if (box_downscale(frame.data, frame.cols, frame.rows, frame.step[0], 3, dst, w, h, dst_stride, true)) return true;
+		code = COLOR_BGR2RGB;
+		break;
+	case CV_8UC1: code = COLOR_GRAY2RGB; break;
+	case CV_8UC4: code = COLOR_BGRA2RGB; break;
+	default: return false;
+	}
+
+	Mat small = {};
+	resize(frame, small, Size(w, h), 0, 0, INTER_AREA);
+	Mat buf = Mat(h, w, CV_8UC3, dst, dst_stride);
+	cvtColor(small, buf, code);
+	small.release();
+	return true;
+}
+
+// Opening and reading are bounded, a file that's broken or on a hung mount costs at most this much of a decoder
+#define VIDEO_OPEN_TIMEOUT_MS 2000
+#define VIDEO_READ_TIMEOUT_MS 2000
+// Far enough in to be past the fade-in, the seek lands on a keyframe and decodes forward from it
+#define VIDEO_SEEK_FRACTION 0.1
+
+// Opens `file_path` through FFmpeg with the timeouts above, whatever else OpenCV has if that fails
+static bool open_video(VideoCapture *cap, const char *file_path)
+{
+	const std::vector<int> params = {
+		CAP_PROP_OPEN_TIMEOUT_MSEC, VIDEO_OPEN_TIMEOUT_MS,
+		CAP_PROP_READ_TIMEOUT_MSEC, VIDEO_READ_TIMEOUT_MS,
+	};
+
+	if (!cap->open(file_path, CAP_FFMPEG, params) && !cap->open(file_path, CAP_ANY)) {
+		eprintf("could not open video file %s\n", file_path);
+		return false;
+	}
+	return true;
+}
+
+// Decodes one frame from about `VIDEO_SEEK_FRACTION` into the video, or the first one when it can't seek,
+// shrinks it to fit `min_size` and converts it to RGB into a buffer of that size
+static bool load_video_frame(const char *file_path, int min_size, Image *img)
+{
+	VideoCapture cap;
+	if (!open_video(&cap, file_path)) return false;
+
+	if (decode_cancelled()) return false;
+
+	Mat frame = {};
+	const double frame_count = cap.get(CAP_PROP_FRAME_COUNT);
+	bool ok = false;
+	if (frame_count > 1 && cap.set(CAP_PROP_POS_FRAMES, (int) (frame_count*VIDEO_SEEK_FRACTION))) {
+		ok = cap.read(frame) && !frame.empty();
+	}
+
+	if (decode_cancelled()) return false;
+
+	// Streams without an index, or that claim more frames than they have
+	if (!ok) {
+		cap.set(CAP_PROP_POS_FRAMES, 0);
+		ok = cap.read(frame) && !frame.empty();
+	}
+
+	cap.release();
+	if (!ok) {
+		eprintf("could not read a frame of %s\n", file_path);
+		return false;
+	}
+
+	if (decode_cancelled()) return false;
+
+	int w = frame.cols, h = frame.rows;
+	if (std::max(w, h) > min_size) {
+		const float scale = (float) min_size/std::max(w, h);
+		w = std::max(1, (int) (w*scale));
+		h = std::max(1, (int) (h*scale));
+	}
+
+	uint8_t *data = (uint8_t*) malloc(w*h*3);
+	const bool converted = convert_frame(frame, data, w, h, (size_t) w*3);
+	frame.release();
+
+	if (!converted) {
+		eprintf("unsupported frame format in %s\n", file_path);
+		free(data);
+		return false;
+	}
+
+	img->data = data;
+	img->width = w;
+	img->height = h;
+	img->mipmaps = 1;
+	img->format = PIXELFORMAT_UNCOMPRESSED_R8G8B8;
+	return true;
+}
+
+// Frames of the strip shown when scrubbing over a video tile, laid out in rows of `SCRUB_COLUMNS`
+// so the sheet stays within texture size limits even for big tiles
+#define SCRUB_FRAMES 10
+#define SCRUB_COLUMNS 5
+// A strip is given up on after that, with whatever frames it has by then
+#define SCRUB_BUDGET_MS 5000
+
+INLINE static void fit_size(int w, int h, int tw, int th, int *nw, int *nh)
+{
+	const float s = std::min((float) tw/w, (float) th/h);
+	*nw = std::max(1, (int) (w*s));
+	*nh = std::max(1, (int) (h*s));
+}
+
+// Samples `SCRUB_FRAMES` frames evenly across the video, each fit into `box_w`x`box_h`,
+// into one RGB sheet, `frame_w`/`frame_h` is the size of a single frame and `frames` how many made it in
+static bool load_video_strip(const char *file_path, int box_w, int box_h, Image *sheet, int *frame_w, int *frame_h, int *frames)
+{
+	VideoCapture cap;
+	if (!open_video(&cap, file_path)) return false;
+
+	const double frame_count = cap.get(CAP_PROP_FRAME_COUNT);
+	if (frame_count < SCRUB_FRAMES) return false;
+
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(SCRUB_BUDGET_MS);
+	const int rows = (SCRUB_FRAMES + SCRUB_COLUMNS - 1) / SCRUB_COLUMNS;
+
+	uint8_t *data = NULL;
+	int w = 0, h = 0, n = 0;
+	Mat frame = {};
+	for (; n < SCRUB_FRAMES; ++n) {
+		if (decode_cancelled() || std::chrono::steady_clock::now() > deadline) break;
+
+		const int pos = (int) (frame_count*(n + 0.5)/SCRUB_FRAMES);
+		if (!cap.set(CAP_PROP_POS_FRAMES, pos) || !cap.read(frame) || frame.empty()) break;
+
+		if (data == NULL) {
+			fit_size(frame.cols, frame.rows, box_w, box_h, &w, &h);
+			data = (uint8_t*) calloc((size_t) SCRUB_COLUMNS*w*rows*h, 3);
+		}
+
+		// The frame is converted straight into its cell in the sheet
+		const size_t stride = (size_t) SCRUB_COLUMNS*w*3;
+		uint8_t *cell = data + (n / SCRUB_COLUMNS)*h*stride + (n % SCRUB_COLUMNS)*w*3;
+		if (!convert_frame(frame, cell, w, h, stride)) break;
+	}
+
+	cap.release();
+	frame.release();
+
+	// One frame is just the thumbnail again
+	if (n < 2 || decode_cancelled()) {
+		free(data);
+		return false;
+	}
+
+	sheet->data = data;
+	sheet->width = SCRUB_COLUMNS*w;
+	sheet->height = rows*h;
+	sheet->mipmaps = 1;
+	sheet->format = PIXELFORMAT_UNCOMPRESSED_R8G8B8;
+	*frame_w = w;
+	*frame_h = h;
+	*frames = n;
+	return true;
+}
+
+INLINE static void get_fit_size(const Image *img, int tw, int th, int *nw, int *nh)
+{
+	const float original_aspect = (float) img->width / img->height;
+	const float target_aspect = (float) tw / th;
+
+	if (original_aspect > target_aspect) {
+		*nw = tw;
+		*nh = tw / original_aspect;
+	} else {
+		*nh = th;
+		*nw = th*original_aspect;
+	}
+}
+
+// A copy of `src` fit into `tw`x`th`, shrunk straight out of `src` when possible
+static Image copy_resized_img(const Image *src, int tw, int th)
+{
+	int nw, nh;
+	get_fit_size(src, tw, th, &nw, &nh);
+
+	Image img = *src;
+	const int channels = get_box_channels(src->format);
+	if (channels != 0 && nw >= 1 && nh >= 1) {
+		img.data = malloc((size_t) nw*nh*channels);
+		if (box_downscale((const uint8_t *) src->data, src->width, src->height, (size_t) src->width*channels, channels,
+											(uint8_t *) img.data, nw, nh, (size_t) nw*channels, false))
+		{
+			img.width = nw;
+			img.height = nh;
+			return img;
+		}
+		free(img.data);
+	}
+
+	// Upscaling, or a format the box filter doesn't take
+	img.data = copy_img_data(src);
+	ImageResize(&img, nw, nh);
+	return img;
+}
+
+static void resize_img(Image *img, int tw, int th)
+{
+	const Image resized = copy_resized_img(img, tw, th);
+	UnloadImage(*img);
+	*img = resized;
+}
+
+#define BENCH_DOWNSCALE_FLAG "--bench-downscale"
+#define BENCH_DOWNSCALE_RUNS 10
+#define BENCH_DOWNSCALE_BOX 256
+
+INLINE static double get_ms_since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// `fe --bench-downscale` times every downscale kernel the CPU has against `ImageResize`
+// on photo and video sized inputs, fit into the box of the large thumbnail flavor
+static void bench_downscale(void)
+{
+	typedef struct {
+		const char *name;
+		int width;
+		int height;
+	} bench_input_t;
+
+	typedef struct {
+		const char *name;
+		accumulate_row_t accumulate_row;
+	} bench_kernel_t;
+
+	const bench_input_t inputs[] = {
+		{"4K", 3840, 2160},
+		{"24MP", 6000, 4000},
+	};
+
+	std::vector<bench_kernel_t> kernels = {{"scalar", accumulate_row_scalar}};
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) kernels.push_back({"sse2", accumulate_row_sse2});
+	if (__builtin_cpu_supports("avx2")) kernels.push_back({"avx2", accumulate_row_avx2});
+#endif
+
+	for (const auto &input: inputs) {
+		for (int channels = 3; channels <= 4; ++channels) {
+			const size_t size = (size_t) input.width*input.height*channels;
+			uint8_t *data = (uint8_t *) malloc(size);
+			for (size_t i = 0; i < size; ++i) data[i] = (uint8_t) (i*2654435761u >> 13);
+
+			const Image src = {
+				.data = data,
+				.width = input.width,
+				.height = input.height,
+				.mipmaps = 1,
+				.format = channels == 3 ? PIXELFORMAT_UNCOMPRESSED_R8G8B8 : PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+			};
+
+			int nw, nh;
+			get_fit_size(&src, BENCH_DOWNSCALE_BOX, BENCH_DOWNSCALE_BOX, &nw, &nh);
+
+			// What the decoders did before: copy, then resize
+			auto start = std::chrono::steady_clock::now();
+			for (int run = 0; run < BENCH_DOWNSCALE_RUNS; ++run) {
+				Image img = src;
+				img.data = copy_img_data(&src);
+				ImageResize(&img, nw, nh);
+				UnloadImage(img);
+			}
+			const double base_ms = get_ms_since(start) / BENCH_DOWNSCALE_RUNS;
+			printf("%-4s %dch -> %dx%d  ImageResize %8.2f ms", input.name, channels, nw, nh, base_ms);
+
+			std::vector<uint8_t> dst((size_t) nw*nh*channels);
+			for (const auto &kernel: kernels) {
+				start = std::chrono::steady_clock::now();
+				for (int run = 0; run < BENCH_DOWNSCALE_RUNS; ++run) {
+					box_downscale_with(kernel.accumulate_row, data, input.width, input.height, (size_t) input.width*channels, channels,
+														 dst.data(), nw, nh, (size_t) nw*channels, false);
+				}
+				const double ms = get_ms_since(start) / BENCH_DOWNSCALE_RUNS;
+				printf("  %s %8.2f ms (%.1fx)", kernel.name, ms, base_ms / ms);
+			}
+			printf("\n");
+
+			free(data);
+		}
+	}
+}
+
+INLINE static void resize_img_to_size_of_tile(Image *img)
+{
+	resize_img(img, tile_width - text_padding, tile_height - text_padding);
+}
+
+INLINE static bool is_png_file(const char *file_path)
+{
+	std::ifstream file(file_path, std::ios::binary);
+	if (!file.is_open()) return false;
+	char buf[8] = {0};
+	file.read(buf, 8);
+	return file.gcount() == 8 && memcmp(buf, PNG_MAGIC_BYTES, 8) == 0;
+}
+
+INLINE static bool is_mp3_file(const char *file_path)
+{
+	TagLib::FileRef file = TagLib::FileRef(file_path);
+	if (file.isNull()) return false;
+	TagLib::AudioProperties *props = file.audioProperties();
+	return props != NULL && props->bitrate() > 0 && props->sampleRate() > 0 && props->channels() > 0;
+}
+
+INLINE static bool is_mp4_file(const char *file_path)
+{
+	std::ifstream file(file_path, std::ios::binary);
+	if (!file.is_open()) return false;
+	char buf[8] = {0};
+	file.read(buf, 8);
+	return file.gcount() == 8 && memcmp(buf + 4, MP4_MAGIC_BYTES, 4) == 0;
+}
+
+INLINE static bool is_image(char *file_path)
+{
+	char *ext = get_extension(file_path);
+	return _is_image(ext) || is_png_file(file_path);
+}
+
+// Cameras write the extension in caps more often than not
+INLINE static bool is_raw(char *file_path)
+{
+	const char *ext = get_extension(file_path);
+	if (ext == NULL) return false;
+
+	for (size_t i = 0; i < RAW_FILE_EXTENSIONS_SIZE; ++i) {
+		if (strcasecmp(ext, RAW_FILE_EXTENSIONS[i]) == 0) return true;
+	}
+	return false;
+}
+
+INLINE static bool is_music(char *file_path)
+{
+	char *ext = get_extension(file_path);
+	return _is_music(ext) || is_mp3_file(file_path);
+}
+
+INLINE static bool is_video(char *file_path)
+{
+	char *ext = get_extension(file_path);
+	return _is_video(ext) || is_mp4_file(file_path);
+}
+
+static void handle_enter(char *file_path_)
+{
+	scratch_buffer_append_full_file_path(get_top_file_path(file_path_));
+	char *file_path = scratch_buffer_to_string();
+	if (is_video(file_path) || is_music(file_path)) {
+		Nob_Cmd cmd = {0};
+		nob_cmd_append(&cmd, "mpv", file_path);
+		const Nob_Proc proc = nob_cmd_run_async(cmd, true);
+		procs.emplace_back(proc);
+	} else if (is_image(file_path)) {
+		Nob_Cmd cmd = {0};
+		nob_cmd_append(&cmd, "mpv", "--loop", file_path);
+		const Nob_Proc proc = nob_cmd_run_async(cmd, true);
+		procs.emplace_back(proc);
+	}
+}
+
+static int comp_to_pixel_format(int comp)
+{
+	switch (comp) {
+	case 1:	 return PIXELFORMAT_UNCOMPRESSED_GRAYSCALE;
+	case 2:	 return PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA;
+	case 3:	 return PIXELFORMAT_UNCOMPRESSED_R8G8B8;
+	case 4:	 return PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
+	default: return -1;
+	}
+	__builtin_unreachable();
+}
+
+// Decoders read files straight from a private read-only mapping, no stdio buffer in between
+typedef struct {
+	uint8_t *data;
+	size_t size;
+} mapped_file_t;
+
+// `advice` is how the decoder is going to go through it, `MADV_SEQUENTIAL` for whole file decoders
+static bool map_file(const char *file_path, int advice, mapped_file_t *file)
+{
+	const int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return false;
+
+	struct stat info;
+	if (fstat(fd, &info) == -1 || !S_ISREG(info.st_mode) || info.st_size == 0) {
+		close(fd);
+		return false;
+	}
+
+	void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) return false;
+
+	madvise(data, info.st_size, advice);
+
+	file->data = (uint8_t *) data;
+	file->size = info.st_size;
+	return true;
+}
+
+INLINE static void unmap_file(mapped_file_t *file)
+{
+	if (file->data != NULL) munmap(file->data, file->size);
+	file->data = NULL;
+	file->size = 0;
+}
+
+// Small files that are parsed in more than one go, like cached thumbnails, are read into `buf` instead,
+// a file truncated meanwhile just comes up short
+static bool read_file(const char *file_path, size_t max_size, std::vector<uint8_t> *buf)
+{
+	const int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return false;
+
+	struct stat info;
+	if (fstat(fd, &info) == -1 || !S_ISREG(info.st_mode) || info.st_size == 0 || (size_t) info.st_size > max_size) {
+		close(fd);
+		return false;
+	}
+
+	buf->resize(info.st_size);
+	size_t n = 0;
+	while (n < buf->size()) {
+		const ssize_t r = read(fd, buf->data() + n, buf->size() - n);
+		if (r == -1 && errno == EINTR) continue;
+		if (r <= 0) break;
+		n += r;
+	}
+	close(fd);
+
+	buf->resize(n);
+	return n > 0;
+}
+
+// A file truncated while it's mapped turns reads past its new end into SIGBUS,
+// decoders jump out of the decode instead of taking the whole program down
+static thread_local sigjmp_buf *map_fault_jmp = NULL;
+
+static void handle_map_fault(int sig)
+{
+	if (map_fault_jmp != NULL) siglongjmp(*map_fault_jmp, 1);
+
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+static void install_map_fault_handler(void)
+{
+	struct sigaction action = {};
+	action.sa_handler = handle_map_fault;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGBUS, &action, NULL);
+}
+
+typedef bool (*mapped_decoder_t)(const uint8_t *mem, size_t size, int min_size, Image *img);
+
+// Maps `file_path`, runs `decode` on it and unmaps it again right away, what's decoded never points into the mapping
+static bool decode_mapped_file(const char *file_path, int advice, mapped_decoder_t decode, int min_size, Image *img)
+{
+	mapped_file_t file = {};
+	if (!map_file(file_path, advice, &file)) {
+		eprintf("failed to open %s\n", file_path);
+		return false;
+	}
+
+	sigjmp_buf jmp;
+	if (sigsetjmp(jmp, 1)) {
+		map_fault_jmp = NULL;
+		unmap_file(&file);
+		eprintf("%s was truncated while being read\n", file_path);
+		return false;
+	}
+
+	map_fault_jmp = &jmp;
+	const bool ok = decode(file.data, file.size, min_size, img);
+	map_fault_jmp = NULL;
+
+	unmap_file(&file);
+	return ok;
+}
+
+static bool load_stbi_from_memory(const uint8_t *mem, size_t size, Image *img)
+{
+	if (size > INT_MAX) return false;
+
+	int comp = 0;
+	img->data = stbi_load_from_memory(mem, (int) size, &img->width, &img->height, &comp, 0);
+	if (img->data == NULL) return false;
+
+	const int format = comp_to_pixel_format(comp);
+	if (format == -1) {
+		free(img->data);
+		img->data = NULL;
+		return false;
+	}
+
+	img->format = format;
+	img->mipmaps = 1;
+	return true;
+}
+
+typedef struct {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jmp;
+} jpeg_error_t;
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	longjmp(((jpeg_error_t *) cinfo->err)->jmp, 1);
+}
+
+static void jpeg_emit_message(j_common_ptr, int) {}
+
+// Decodes `mem` through libjpeg's scaled IDCT at the smallest 1/8, 1/4, 1/2 or 1/1 scale
+// whose longer side is still at least `min_size`, falls back to stb_image for whatever it can't do,
+// `strict` refuses images that are smaller than `min_size` to begin with
+static bool load_jpeg_scaled(const uint8_t *mem, size_t mem_size, int min_size, bool strict, Image *img)
+{
+	struct jpeg_decompress_struct cinfo = {};
+	jpeg_error_t err = {};
+	uint8_t *volatile data = NULL;
+
+	cinfo.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = jpeg_error_exit;
+	err.mgr.emit_message = jpeg_emit_message;
+
+	if (setjmp(err.jmp)) {
+		jpeg_destroy_decompress(&cinfo);
+		free(data);
+		return false;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, mem, mem_size);
+	jpeg_read_header(&cinfo, TRUE);
+
+	if (strict && (int) std::max(cinfo.image_width, cinfo.image_height) < min_size) {
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+
+	// CMYK and friends have no conversion to RGB in libjpeg
+	if (cinfo.jpeg_color_space != JCS_GRAYSCALE
+	&&  cinfo.jpeg_color_space != JCS_YCbCr
+	&&  cinfo.jpeg_color_space != JCS_RGB)
+	{
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+
+	cinfo.out_color_space = cinfo.jpeg_color_space == JCS_GRAYSCALE ? JCS_GRAYSCALE : JCS_RGB;
+	cinfo.scale_num = 1;
+	for (unsigned denom = 8; denom >= 1; denom /= 2) {
+		cinfo.scale_denom = denom;
+		jpeg_calc_output_dimensions(&cinfo);
+		if (min_size <= 0 || (int) std::max(cinfo.output_width, cinfo.output_height) >= min_size) break;
+	}
+
+	// Scaled by the IDCT already, the rest of the quality knobs don't matter at tile size
+	cinfo.dct_method = JDCT_IFAST;
+	cinfo.do_fancy_upsampling = FALSE;
+
+	jpeg_start_decompress(&cinfo);
+
+	const size_t stride = (size_t) cinfo.output_width*cinfo.output_components;
+	data = (uint8_t *) malloc(stride*cinfo.output_height);
+
+	while (cinfo.output_scanline < cinfo.output_height) {
+		if (decode_cancelled()) {
+			jpeg_abort_decompress(&cinfo);
+			jpeg_destroy_decompress(&cinfo);
+			free(data);
+			return false;
+		}
+
+		JSAMPROW row = data + cinfo.output_scanline*stride;
+		jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+
+	jpeg_finish_decompress(&cinfo);
+
+	img->data = data;
+	img->width = cinfo.output_width;
+	img->height = cinfo.output_height;
+	img->mipmaps = 1;
+	img->format = cinfo.output_components == 1 ? PIXELFORMAT_UNCOMPRESSED_GRAYSCALE : PIXELFORMAT_UNCOMPRESSED_R8G8B8;
+
+	jpeg_destroy_decompress(&cinfo);
+	return true;
+}
+
+INLINE static uint32_t get_tiff_u16(const uint8_t *p, bool le)
+{
+	return le ? p[0] | (p[1] << 8) : (p[0] << 8) | p[1];
+}
+
+INLINE static uint32_t get_tiff_u32(const uint8_t *p, bool le)
+{
+	return le ? p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24)
+						: ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// The embedded JPEG of the second IFD (IFD1) of a TIFF structure, which is where EXIF keeps its thumbnail
+static bool find_exif_thumbnail(const uint8_t *tiff, size_t size, size_t *thumb_off, size_t *thumb_size)
+{
+	if (size < 8) return false;
+
+	bool le = false;
+	if (memcmp(tiff, "II", 2) == 0) le = true;
+	else if (memcmp(tiff, "MM", 2) != 0) return false;
+
+	if (get_tiff_u16(tiff + 2, le) != 42) return false;
+
+	const size_t ifd0 = get_tiff_u32(tiff + 4, le);
+	if (ifd0 + 2 > size) return false;
+
+	const size_t next = ifd0 + 2 + get_tiff_u16(tiff + ifd0, le)*12;
+	if (next + 4 > size) return false;
+
+	const size_t ifd1 = get_tiff_u32(tiff + next, le);
+	if (ifd1 == 0 || ifd1 + 2 > size) return false;
+
+	size_t off = 0, len = 0;
+	const size_t count = get_tiff_u16(tiff + ifd1, le);
+	for (size_t i = 0; i < count; ++i) {
+		const uint8_t *e = tiff + ifd1 + 2 + i*12;
+		if (e + 12 > tiff + size) return false;
+
+		switch (get_tiff_u16(e, le)) {
+		case 0x0201: off = get_tiff_u32(e + 8, le); break; // JPEGInterchangeFormat
+		case 0x0202: len = get_tiff_u32(e + 8, le); break; // JPEGInterchangeFormatLength
+		default: break;
+		}
+	}
+
+	if (off == 0 || len == 0 || off > size || len > size - off) return false;
+
+	*thumb_off = off;
+	*thumb_size = len;
+	return true;
+}
+
+// Decodes only the thumbnail in the EXIF segment of a JPEG, if there is one that's at least `min_size`,
+// the segment is usually the first or second one, so only the first pages of the mapping are touched
+static bool load_exif_thumbnail(const uint8_t *mem, size_t size, int min_size, Image *img)
+{
+	for (size_t off = 2; off + 4 <= size;) {
+		if (mem[off] != 0xFF) return false;
+
+		const uint8_t marker = mem[off + 1];
+		if (marker == 0xFF) {
+			off++;
+			continue;
+		}
+
+		// Start of scan, or the end, there's no metadata past that
+		if (marker == 0xDA || marker == 0xD9) return false;
+
+		const size_t len = (mem[off + 2] << 8) | mem[off + 3];
+		if (len < 2) return false;
+
+		if (marker == 0xE1 && len >= 8 + 8 && off + 2 + len <= size && memcmp(&mem[off + 4], "Exif\0\0", 6) == 0) {
+			const uint8_t *tiff = &mem[off + 10];
+			size_t thumb_off = 0, thumb_size = 0;
+			if (!find_exif_thumbnail(tiff, len - 8, &thumb_off, &thumb_size)) return false;
+
+			return load_jpeg_scaled(tiff + thumb_off, thumb_size, min_size, true, img);
+		}
+
+		off += 2 + len;
+	}
+
+	return false;
+}
+
+INLINE static bool is_jpeg_data(const uint8_t *mem, size_t size)
+{
+	return size >= 3 && memcmp(mem, JPEG_MAGIC_BYTES, 3) == 0;
+}
+
+// A RAW file is a TIFF whose IFDs point at the sensor data and at one or more JPEG previews,
+// only the IFDs and the headers of the JPEGs are read to pick one
+#define RAW_MAX_IFDS 16
+#define RAW_MAX_IFD_ENTRIES 512
+#define RAW_MAX_PREVIEWS 16
+#define RAW_SNIFF_SIZE (16*1024)
+
+struct raw_preview_t {
+	size_t off;
+	size_t len;
+	int width;
+	int height;
+};
+
+// Dimensions of the JPEG at `off`, as long as it's a baseline or progressive one libjpeg can decode.
+// CR2 and DNG store the sensor data as lossless JPEG too, that one is skipped by its SOF3 marker
+static bool sniff_raw_jpeg(const uint8_t *file, raw_preview_t *preview)
+{
+	const uint8_t *buf = file + preview->off;
+	const size_t n = std::min((size_t) RAW_SNIFF_SIZE, preview->len);
+	if (n < 4 || buf[0] != 0xFF || buf[1] != 0xD8) return false;
+
+	for (size_t off = 2; off + 9 <= n;) {
+		if (buf[off] != 0xFF) return false;
+
+		const uint8_t marker = buf[off + 1];
+		if (marker == 0xFF) {
+			off++;
+			continue;
+		}
+
+		if (marker == 0xC0 || marker == 0xC1 || marker == 0xC2) {
+			preview->height = (buf[off + 5] << 8) | buf[off + 6];
+			preview->width = (buf[off + 7] << 8) | buf[off + 8];
+			return preview->width > 0 && preview->height > 0;
+		}
+
+		// Any other SOF, or the scan started without one
+		if ((marker >= 0xC3 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) || marker == 0xDA) {
+			return false;
+		}
+
+		off += 2 + ((buf[off + 2] << 8) | buf[off + 3]);
+	}
+
+	return false;
+}
+
+// Broken files can point IFDs back at each other, each one is only visited once
+INLINE static void push_raw_ifd(size_t *ifds, size_t *ifds_count, size_t ifd)
+{
+	if (ifd == 0 || *ifds_count >= RAW_MAX_IFDS) return;
+	for (size_t i = 0; i < *ifds_count; ++i) {
+		if (ifds[i] == ifd) return;
+	}
+	ifds[(*ifds_count)++] = ifd;
+}
+
+// Walks IFD0's chain and the SubIFDs hanging off it, collecting every JPEG that's described
+// either as a JPEGInterchangeFormat pair or as a single JPEG compressed strip
+static size_t find_raw_previews(const uint8_t *file, size_t file_size, raw_preview_t *previews)
+{
+	if (file_size < 8) return 0;
+
+	bool le = false;
+	if (memcmp(file, "II", 2) == 0) le = true;
+	else if (memcmp(file, "MM", 2) != 0) return 0;
+
+	if (get_tiff_u16(file + 2, le) != 42) return 0;
+
+	size_t ifds[RAW_MAX_IFDS];
+	size_t ifds_count = 0, visited = 0, previews_count = 0;
+	push_raw_ifd(ifds, &ifds_count, get_tiff_u32(file + 4, le));
+
+	while (visited < ifds_count) {
+		const size_t ifd = ifds[visited++];
+		if (ifd < 8 || ifd + 2 > file_size) continue;
+
+		const size_t count = std::min((size_t) get_tiff_u16(file + ifd, le), (size_t) RAW_MAX_IFD_ENTRIES);
+		if (ifd + 2 + count*12 > file_size) continue;
+
+		size_t jpeg_off = 0, jpeg_len = 0, strip_off = 0, strip_len = 0;
+		uint32_t compression = 0;
+		for (size_t i = 0; i < count; ++i) {
+			const uint8_t *e = file + ifd + 2 + i*12;
+			const uint32_t type = get_tiff_u16(e + 2, le);
+			const uint32_t values = get_tiff_u32(e + 4, le);
+			// SHORTs sit in the first half of the value field, LONGs and IFDs fill it
+			const uint32_t value = type == 3 ? get_tiff_u16(e + 8, le) : get_tiff_u32(e + 8, le);
+
+			switch (get_tiff_u16(e, le)) {
+			case 0x0103: compression = value; break;
+			case 0x0111: if (values == 1) strip_off = value; break; // StripOffsets
+			case 0x0117: if (values == 1) strip_len = value; break; // StripByteCounts
+			case 0x0201: jpeg_off = value; break; // JPEGInterchangeFormat
+			case 0x0202: jpeg_len = value; break; // JPEGInterchangeFormatLength
+			case 0x014A: { // SubIFDs
+				if (type != 4 && type != 13) break;
+				if (values == 1) {
+					push_raw_ifd(ifds, &ifds_count, value);
+					break;
+				}
+
+				const size_t wanted = std::min((size_t) values, (size_t) RAW_MAX_IFDS)*4;
+				if (value > file_size || wanted > file_size - value) break;
+				for (size_t j = 0; j < wanted; j += 4) {
+					push_raw_ifd(ifds, &ifds_count, get_tiff_u32(file + value + j, le));
+				}
+			} break;
+			default: break;
+			}
+		}
+
+		// 6 is old-style JPEG, 7 is JPEG, which DNG also uses for lossless sensor data, sniffing tells them apart
+		if (jpeg_len == 0 && (compression == 6 || compression == 7)) {
+			jpeg_off = strip_off;
+			jpeg_len = strip_len;
+		}
+
+		if (jpeg_off != 0 && jpeg_len != 0 && jpeg_off < file_size && jpeg_len <= file_size - jpeg_off && previews_count < RAW_MAX_PREVIEWS) {
+			raw_preview_t *preview = &previews[previews_count];
+			preview->off = jpeg_off;
+			preview->len = jpeg_len;
+			if (sniff_raw_jpeg(file, preview)) previews_count++;
+		}
+
+		const size_t next = ifd + 2 + count*12;
+		if (next + 4 <= file_size) push_raw_ifd(ifds, &ifds_count, get_tiff_u32(file + next, le));
+	}
+
+	return previews_count;
+}
+
+// Decodes the smallest embedded JPEG that still covers `min_size`, or the largest one if none does.
+// That's the biggest preview for a tile the size of a screen, and a thumbnail sized one otherwise,
+// only the IFDs, the headers of the JPEGs and the chosen one are ever paged in
+static bool load_raw_preview(const uint8_t *file, size_t file_size, int min_size, Image *img)
+{
+	raw_preview_t previews[RAW_MAX_PREVIEWS];
+	const size_t count = find_raw_previews(file, file_size, previews);
+	if (count == 0) return false;
+
+	const raw_preview_t *best = NULL;
+	for (size_t i = 0; i < count; ++i) {
+		const raw_preview_t *p = &previews[i];
+		const bool covers = std::max(p->width, p->height) >= min_size;
+		if (best == NULL) {
+			best = p;
+			continue;
+		}
+
+		const bool best_covers = std::max(best->width, best->height) >= min_size;
+		const size_t area = (size_t) p->width*p->height, best_area = (size_t) best->width*best->height;
+		if (covers && (!best_covers || area < best_area)) best = p;
+		else if (!covers && !best_covers && area > best_area) best = p;
+	}
+
+	if (decode_cancelled()) return false;
+
+	// Read ahead just the chosen JPEG, the mapping as a whole is read at random
+	const uint8_t *jpeg = file + best->off;
+	const uintptr_t page_off = (uintptr_t) jpeg & (getpagesize() - 1);
+	madvise((void *) (jpeg - page_off), best->len + page_off, MADV_WILLNEED);
+
+	if (load_jpeg_scaled(jpeg, best->len, min_size, false, img)) return true;
+	if (decode_cancelled()) return false;
+
+	return load_stbi_from_memory(jpeg, best->len, img);
+}
+
+// Decodes the cover in the ID3v2 tag of an MP3 straight out of TagLib's buffer, the file has to stay alive for that
+static bool load_album_cover(const char *file_path, int min_size, Image *img)
+{
+	MPEG::File file = MPEG::File(file_path);
+	ID3v2::Tag *id3v2_tag = file.ID3v2Tag();
+
+	if (!id3v2_tag) return false;
+	const auto &frames = id3v2_tag->frameListMap()["APIC"];
+	if (frames.isEmpty()) return false;
+
+	const auto *picture_frame = (ID3v2::AttachedPictureFrame *) (frames.front());
+	if (!picture_frame) return false;
+
+	const ByteVector &image_data = picture_frame->picture();
+	const uint8_t *data = (const uint8_t *) image_data.data();
+	const size_t size = image_data.size();
+
+	if (size == 0 || decode_cancelled()) return false;
+
+	if (is_jpeg_data(data, size) && load_jpeg_scaled(data, size, min_size, false, img)) return true;
+	if (decode_cancelled()) return false;
+
+	return load_stbi_from_memory(data, size, img);
+}
+
+// Everything stb_image and libjpeg can decode, JPEGs through their EXIF thumbnail or the scaled IDCT if possible
+static bool load_image_from_memory(const uint8_t *mem, size_t size, int min_size, Image *img)
+{
+	if (is_jpeg_data(mem, size)) {
+		// Kilobytes of EXIF thumbnail instead of megabytes of photo, if it's big enough
+		if (load_exif_thumbnail(mem, size, min_size, img)) return true;
+		if (load_jpeg_scaled(mem, size, min_size, false, img)) return true;
+	}
+
+	if (decode_cancelled()) return false;
+	return load_stbi_from_memory(mem, size, img);
+}
+
+// `min_size` is the size the preview ends up fit into, decoders that can scale on the fly don't go below it
+static bool get_preview(char *file_path, Image *img, int min_size)
+{
+	if (is_video(file_path)) {
+		return load_video_frame(file_path, min_size, img);
+	} else if (is_music(file_path)) {
+		return load_album_cover(file_path, min_size, img);
+	} else if (is_raw(file_path)) {
+		const bool ok = decode_mapped_file(file_path, MADV_RANDOM, load_raw_preview, min_size, img);
+		if (!ok && !decode_cancelled()) eprintf("no embedded preview in %s\n", file_path);
+		return ok;
+	} else if (is_image(file_path)) {
+		const bool ok = decode_mapped_file(file_path, MADV_SEQUENTIAL, load_image_from_memory, min_size, img);
+		if (!ok && !decode_cancelled()) eprintf("failed to load image from %s\n", file_path);
+		return ok;
+	}
+
+	return false;
+}
+
+// Thumbnails are shared with other desktop tools through the freedesktop thumbnail cache,
+// set `FE_THUMBNAIL_CACHE=0` to always decode from scratch
+#define THUMBNAIL_CACHE_ENV "FE_THUMBNAIL_CACHE"
+
+// Even an xx-large thumbnail stays well below that, anything bigger isn't one of ours
+#define THUMBNAIL_MAX_FILE_SIZE (16*MB)
+
+typedef struct {
+	const char *name;
+	int size;
+} thumbnail_flavor_t;
+
+static const thumbnail_flavor_t THUMBNAIL_FLAVORS[] = {
+	{"normal", 128},
+	{"large", 256},
+	{"x-large", 512},
+	{"xx-large", 1024},
+};
+DEFINE_SIZE(THUMBNAIL_FLAVORS);
+
+static const uint32_t MD5_K[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t MD5_S[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+// Thumbnails are named by the MD5 of the file URI, in lowercase hex
+static void md5_hex(const char *data, size_t size, char out[33])
+{
+	uint32_t h[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+
+	std::vector<uint8_t> msg(data, data + size);
+	msg.push_back(0x80);
+	while (msg.size() % 64 != 56) msg.push_back(0);
+
+	const uint64_t bits = (uint64_t) size*8;
+	for (int i = 0; i < 8; ++i) msg.push_back((uint8_t) (bits >> (8*i)));
+
+	for (size_t off = 0; off < msg.size(); off += 64) {
+		uint32_t w[16];
+		for (int i = 0; i < 16; ++i) {
+			const uint8_t *p = &msg[off + 4*i];
+			w[i] = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+		}
+
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+		for (int i = 0; i < 64; ++i) {
+			uint32_t f = 0;
+			int g = 0;
+			if (i < 16) {
+				f = (b & c) | (~b & d);
+				g = i;
+			} else if (i < 32) {
+				f = (d & b) | (~d & c);
+				g = (5*i + 1) % 16;
+			} else if (i < 48) {
+				f = b ^ c ^ d;
+				g = (3*i + 5) % 16;
+			} else {
+				f = c ^ (b | ~d);
+				g = (7*i) % 16;
+			}
+
+			const uint32_t x = a + f + MD5_K[i] + w[g];
+			a = d;
+			d = c;
+			c = b;
+			b += (x << MD5_S[i]) | (x >> (32 - MD5_S[i]));
+		}
+
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+	}
+
+	for (int i = 0; i < 16; ++i) {
+		snprintf(out + 2*i, 3, "%02x", (h[i/4] >> (8*(i%4))) & 0xff);
+	}
+}
+
+static uint32_t crc32_of(const uint8_t *data, size_t size, uint32_t crc = 0)
+{
+	static uint32_t table[256] = {0};
+	static std::once_flag table_once;
+	std::call_once(table_once, [] {
+		for (uint32_t n = 0; n < 256; ++n) {
+			uint32_t c = n;
+			for (int k = 0; k < 8; ++k) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+	});
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; ++i) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static uint32_t adler32_of(const uint8_t *data, size_t size)
+{
+	uint32_t a = 1, b = 0;
+	for (size_t i = 0; i < size; ++i) {
+		a = (a + data[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+	return (b << 16) | a;
+}
+
+INLINE static void put_u32_be(std::vector<uint8_t> *out, uint32_t v)
+{
+	out->push_back(v >> 24);
+	out->push_back(v >> 16);
+	out->push_back(v >> 8);
+	out->push_back(v);
+}
+
+INLINE static uint32_t get_u32_be(const uint8_t *p)
+{
+	return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put_png_chunk(std::vector<uint8_t> *out, const char *type, const uint8_t *data, size_t size)
+{
+	put_u32_be(out, size);
+	const size_t start = out->size();
+	out->insert(out->end(), type, type + 4);
+	if (size > 0) out->insert(out->end(), data, data + size);
+	put_u32_be(out, crc32_of(out->data() + start, 4 + size));
+}
+
+// `file://` + the absolute path, escaped the way GLib does it, so the MD5s match the ones of other tools
+static bool get_thumbnail_uri(const char *file_path, std::string *uri)
+{
+	char abs_path[PATH_MAX];
+	if (realpath(file_path, abs_path) == NULL) return false;
+
+	static const char *safe = "-._~!$&'()*+,=:@/";
+
+	*uri = "file://";
+	for (const char *p = abs_path; *p != '\0'; ++p) {
+		const unsigned char c = *p;
+		if (isalnum(c) || strchr(safe, c) != NULL) {
+			uri->push_back(c);
+		} else {
+			char hex[4];
+			snprintf(hex, sizeof(hex), "%%%02X", c);
+			uri->append(hex);
+		}
+	}
+
+	return true;
+}
+
+// `$XDG_CACHE_HOME`, or `~/.cache` without it, empty if there's neither
+static const std::string &get_cache_dir(void)
+{
+	static const std::string dir = [] {
+		const char *xdg = getenv("XDG_CACHE_HOME");
+		if (xdg != NULL && *xdg == '/') return std::string(xdg);
+		const char *home = getenv("HOME");
+		return home == NULL ? std::string() : std::string(home) + "/.cache";
+	}();
+	return dir;
+}
+
+static const std::string &get_thumbnail_dir(void)
+{
+	static const std::string dir = get_cache_dir().empty() ? std::string() : get_cache_dir() + "/thumbnails";
+	return dir;
+}
+
+// The smallest flavor that still covers tiles of `box_size`
+static const thumbnail_flavor_t *get_thumbnail_flavor(int box_size)
+{
+	for (const auto &flavor: THUMBNAIL_FLAVORS) {
+		if (flavor.size >= box_size) return &flavor;
+	}
+	return &THUMBNAIL_FLAVORS[THUMBNAIL_FLAVORS_SIZE - 1];
+}
+
+static std::string get_thumbnail_path(const std::string &uri, const thumbnail_flavor_t *flavor)
+{
+	char md5[33];
+	md5_hex(uri.data(), uri.size(), md5);
+	return get_thumbnail_dir() + "/" + flavor->name + "/" + md5 + ".png";
+}
+
+// Whether the tEXt chunks of a cached thumbnail say it's of `uri` as it is now
+static bool is_cached_thumbnail_valid(const uint8_t *png, size_t png_size, const std::string &uri, const struct stat *info)
+{
+	if (png_size < 8 || memcmp(png, PNG_MAGIC_BYTES, 8) != 0) return false;
+
+	std::string thumb_uri = {}, thumb_mtime = {}, thumb_size = {};
+	for (size_t off = 8; off + 12 <= png_size;) {
+		const uint32_t len = get_u32_be(&png[off]);
+		const char *type = (const char *) &png[off + 4];
+		if (off + 12 + (size_t) len > png_size) return false;
+
+		if (memcmp(type, "tEXt", 4) == 0) {
+			const char *text = (const char *) &png[off + 8];
+			const size_t key_len = strnlen(text, len);
+			if (key_len < len) {
+				const std::string value(text + key_len + 1, len - key_len - 1);
+				if (strncmp(text, "Thumb::URI", key_len) == 0 && key_len == 10) thumb_uri = value;
+				else if (strncmp(text, "Thumb::MTime", key_len) == 0 && key_len == 12) thumb_mtime = value;
+				else if (strncmp(text, "Thumb::Size", key_len) == 0 && key_len == 11) thumb_size = value;
+			}
+		} else if (memcmp(type, "IEND", 4) == 0) {
+			break;
+		}
+
+		off += 12 + len;
+	}
+
+	if (thumb_uri != uri || thumb_mtime != std::to_string((long long) info->st_mtim.tv_sec)) return false;
+	if (!thumb_size.empty() && thumb_size != std::to_string((long long) info->st_size)) return false;
+
+	return true;
+}
+
+// Reads the thumbnail of `uri` back if its `Thumb::MTime` (and `Thumb::Size`, if it's there) still match the file
+static bool load_cached_thumbnail(const std::string &uri,
+																	const struct stat *info,
+																	const thumbnail_flavor_t *flavor,
+																	Image *img)
+{
+	const std::string thumb_path = get_thumbnail_path(uri, flavor);
+
+	// Checked and decoded in two goes, outside of `decode_mapped_file`, so it's read rather than mapped
+	std::vector<uint8_t> buf = {};
+	if (!read_file(thumb_path.c_str(), THUMBNAIL_MAX_FILE_SIZE, &buf)) return false;
+
+	return is_cached_thumbnail_valid(buf.data(), buf.size(), uri, info) && load_stbi_from_memory(buf.data(), buf.size(), img);
+}
+
+static bool encode_png(const Image *src, const std::vector<std::pair<const char *, std::string>> &texts, std::vector<uint8_t> *out)
+{
+	Image img = *src;
+	int color_type = 0;
+	switch (img.format) {
+	case PIXELFORMAT_UNCOMPRESSED_GRAYSCALE:	color_type = 0; break;
+	case PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA: color_type = 4; break;
+	case PIXELFORMAT_UNCOMPRESSED_R8G8B8:			color_type = 2; break;
+	case PIXELFORMAT_UNCOMPRESSED_R8G8B8A8:		color_type = 6; break;
+	default: return false;
+	}
+
+	const int bpp = GetPixelDataSize(1, 1, img.format);
+	const size_t stride = (size_t) img.width*bpp;
+	const uint8_t *pixels = (const uint8_t *) img.data;
+
+	// Every row goes through the Sub filter, which is cheap and compresses photos a lot better than None
+	std::vector<uint8_t> raw((stride + 1)*img.height);
+	for (int y = 0; y < img.height; ++y) {
+		const uint8_t *row = pixels + y*stride;
+		uint8_t *dst = &raw[y*(stride + 1)];
+		dst[0] = 1;
+		for (size_t x = 0; x < stride; ++x) {
+			dst[1 + x] = row[x] - (x >= (size_t) bpp ? row[x - bpp] : 0);
+		}
+	}
+
+	int deflated_size = 0;
+	uint8_t *deflated = CompressData(raw.data(), raw.size(), &deflated_size);
+	if (deflated == NULL) return false;
+
+	// `CompressData` gives a bare deflate stream, PNG wants it in a zlib wrapper
+	std::vector<uint8_t> idat = {0x78, 0x01};
+	idat.insert(idat.end(), deflated, deflated + deflated_size);
+	put_u32_be(&idat, adler32_of(raw.data(), raw.size()));
+	MemFree(deflated);
+
+	out->insert(out->end(), PNG_MAGIC_BYTES, PNG_MAGIC_BYTES + 8);
+
+	std::vector<uint8_t> ihdr = {};
+	put_u32_be(&ihdr, img.width);
+	put_u32_be(&ihdr, img.height);
+	ihdr.push_back(8);
+	ihdr.push_back(color_type);
+	ihdr.push_back(0);
+	ihdr.push_back(0);
+	ihdr.push_back(0);
+	put_png_chunk(out, "IHDR", ihdr.data(), ihdr.size());
+
+	for (const auto &text: texts) {
+		std::vector<uint8_t> chunk(text.first, text.first + strlen(text.first) + 1);
+		chunk.insert(chunk.end(), text.second.begin(), text.second.end());
+		put_png_chunk(out, "tEXt", chunk.data(), chunk.size());
+	}
+
+	put_png_chunk(out, "IDAT", idat.data(), idat.size());
+	put_png_chunk(out, "IEND", NULL, 0);
+	return true;
+}
+
+// Writes the thumbnail next to where other tools look for it, through a temporary file so nobody sees half of it
+static void save_thumbnail(const std::string &uri,
+													 const struct stat *info,
+													 const thumbnail_flavor_t *flavor,
+													 const Image *img)
+{
+	const std::string &dir = get_thumbnail_dir();
+	if (dir.empty()) return;
+
+	std::vector<uint8_t> png = {};
+	const std::vector<std::pair<const char *, std::string>> texts = {
+		{"Thumb::URI", uri},
+		{"Thumb::MTime", std::to_string((long long) info->st_mtim.tv_sec)},
+		{"Thumb::Size", std::to_string((long long) info->st_size)},
+		{"Software", "fe"},
+	};
+
+	if (!encode_png(img, texts, &png)) return;
+
+	// Failing any of these because they exist already is fine, failing otherwise shows up in `open`
+	mkdir(dir.substr(0, dir.rfind('/')).c_str(), 0700);
+	mkdir(dir.c_str(), 0700);
+	mkdir((dir + "/" + flavor->name).c_str(), 0700);
+
+	const std::string thumb_path = get_thumbnail_path(uri, flavor);
+	const std::string tmp_path = thumb_path + "." + std::to_string((long) syscall(SYS_gettid)) + ".tmp";
+
+	const int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1) return;
+
+	const bool ok = write(fd, png.data(), png.size()) == (ssize_t) png.size();
+	close(fd);
+
+	if (!ok || rename(tmp_path.c_str(), thumb_path.c_str()) == -1) unlink(tmp_path.c_str());
+}
+
+// `get_preview` behind the thumbnail cache, `info` is NULL unless `file_path` is a regular file,
+// `box_size` is `tile_box_size` as of when it was asked for, `*thumb_size` is the flavor `img` was fit into,
+// or 0 if it's the original
+static bool get_cached_preview(char *file_path, const struct stat *info, int box_size, Image *img, int *thumb_size)
+{
+	static const bool enabled = getenv_flag(THUMBNAIL_CACHE_ENV, true);
+
+	*thumb_size = 0;
+
+	std::string uri = {};
+	const bool cacheable = enabled &&
+												 info != NULL &&
+												 !get_thumbnail_dir().empty() &&
+												 get_thumbnail_uri(file_path, &uri) &&
+												 // The spec says thumbnails of thumbnails are not a thing
+												 uri.find(get_thumbnail_dir()) == std::string::npos;
+
+	const thumbnail_flavor_t *flavor = get_thumbnail_flavor(box_size);
+
+	if (cacheable && load_cached_thumbnail(uri, info, flavor, img)) {
+		*thumb_size = flavor->size;
+		return true;
+	}
+
+	if (!get_preview(file_path, img, flavor->size) || img->data == NULL) return false;
+	if (decode_cancelled()) return true;
+
+	// Whatever was decoded at scale is only good up to the flavor anyway, so everything is fit into it
+	if (img->width > flavor->size || img->height > flavor->size) {
+		resize_img(img, flavor->size, flavor->size);
+	}
+
+	*thumb_size = flavor->size;
+	if (cacheable) save_thumbnail(uri, info, flavor, img);
+	return true;
+}
+
+// Per-directory packs of tile-sized RGBA previews under the `fe/packs` of the cache directory, mapped straight into
+// the img map without a copy, set `FE_THUMBNAIL_PACK=0` to do without them
+#define THUMBNAIL_PACK_ENV "FE_THUMBNAIL_PACK"
+#define PACK_MAGIC "FEPACK01"
+#define PACK_INITIAL_CAPACITY 256
+#define PACK_PAGE_SIZE 4096
+
+// A pack file is this header, an index of `capacity` entries, then `capacity` blobs of `box_w*box_h` RGBA pixels,
+// starting at the first page boundary after the index. It's sized for all of them up front, so that
+// blobs written later on show up in the existing mapping
+typedef struct {
+	char magic[8];
+	uint32_t box_w;
+	uint32_t box_h;
+	uint32_t capacity;
+	uint32_t count;
+} pack_header_t;
+
+// `width` of 0 is an unused entry
+typedef struct {
+	uint64_t ino;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t size;
+	uint32_t width;
+	uint32_t height;
+} pack_entry_t;
+
+typedef struct {
+	std::string dir;
+	std::string file_path;
+	int fd;
+	uint8_t *map;
+	size_t map_size;
+	uint32_t box_w;
+	uint32_t box_h;
+	uint32_t capacity;
+	uint32_t count;
+	std::unordered_map<uint64_t, uint32_t> slots;
+	// Being copied into a bigger pack without `pack_mtx`, nothing is stored meanwhile
+	bool growing;
+	// There's no file at `file_path` yet, the first `store_in_pack` creates it,
+	// so directories without anything to preview don't get a pack
+	bool lazy;
+} pack_t;
+
+// The pack of the current directory at the current tile size, guarded by `pack_mtx`
+static std::mutex pack_mtx;
+static pack_t pack = {.fd = -1};
+
+// Every image handed out of a pack holds a reference to its mapping, a mapping is unmapped once
+// its pack is closed or grown out of and the last of them is gone
+typedef struct {
+	size_t size;
+	size_t refs;
+	bool retired;
+} pack_mapping_t;
+
+// Keyed by start address so `unload_preview_img` can tell mapped pixels from allocated ones,
+// guarded by `pack_mappings_mtx`, which is taken last: on its own, inside `pack_mtx` or inside `img_map_mtx`,
+// but never the other way around
+static std::mutex pack_mappings_mtx;
+static std::map<uintptr_t, pack_mapping_t> pack_mappings = {};
+
+INLINE static size_t get_pack_index_size(uint32_t capacity)
+{
+	const size_t size = sizeof(pack_header_t) + (size_t) capacity*sizeof(pack_entry_t);
+	return (size + PACK_PAGE_SIZE - 1) / PACK_PAGE_SIZE * PACK_PAGE_SIZE;
+}
+
+INLINE static size_t get_pack_blob_size(uint32_t box_w, uint32_t box_h)
+{
+	return (size_t) box_w*box_h*4;
+}
+
+INLINE static size_t get_pack_file_size(uint32_t box_w, uint32_t box_h, uint32_t capacity)
+{
+	return get_pack_index_size(capacity) + (size_t) capacity*get_pack_blob_size(box_w, box_h);
+}
+
+INLINE static pack_entry_t *get_pack_entry(const pack_t *p, uint32_t slot)
+{
+	return (pack_entry_t *) (p->map + sizeof(pack_header_t)) + slot;
+}
+
+INLINE static uint8_t *get_pack_blob(const pack_t *p, uint32_t slot)
+{
+	return p->map + get_pack_index_size(p->capacity) + (size_t) slot*get_pack_blob_size(p->box_w, p->box_h);
+}
+
+// The mapping `data` points into, needs `pack_mappings_mtx`
+static std::map<uintptr_t, pack_mapping_t>::iterator find_pack_mapping(const void *data)
+{
+	const uintptr_t addr = (uintptr_t) data;
+
+	auto it = pack_mappings.upper_bound(addr);
+	if (it == pack_mappings.begin()) return pack_mappings.end();
+	--it;
+	return addr < it->first + it->second.size ? it : pack_mappings.end();
+}
+
+// Needs `pack_mappings_mtx`
+static void put_pack_mapping(std::map<uintptr_t, pack_mapping_t>::iterator it)
+{
+	if (it->second.refs > 0 || !it->second.retired) return;
+
+	munmap((void *) it->first, it->second.size);
+	pack_mappings.erase(it);
+}
+
+static bool is_pack_mapped(const void *data)
+{
+	std::lock_guard<std::mutex> lock(pack_mappings_mtx);
+	return find_pack_mapping(data) != pack_mappings.end();
+}
+
+static void acquire_pack_mapping(const void *data)
+{
+	std::lock_guard<std::mutex> lock(pack_mappings_mtx);
+	auto it = find_pack_mapping(data);
+	if (it != pack_mappings.end()) it->second.refs++;
+}
+
+// False if `data` isn't in a pack at all
+static bool release_pack_mapping(const void *data)
+{
+	std::lock_guard<std::mutex> lock(pack_mappings_mtx);
+	auto it = find_pack_mapping(data);
+	if (it == pack_mappings.end()) return false;
+
+	it->second.refs--;
+	put_pack_mapping(it);
+	return true;
+}
+
+// The pack is done with `map`, it goes away with the last image that points into it
+static void retire_pack_mapping(const void *map)
+{
+	std::lock_guard<std::mutex> lock(pack_mappings_mtx);
+	auto it = pack_mappings.find((uintptr_t) map);
+	if (it == pack_mappings.end()) return;
+
+	it->second.retired = true;
+	put_pack_mapping(it);
+}
+
+// Previews that came out of a pack point into its mapping, which must not be freed, only let go of
+INLINE static void unload_preview_img(Image img)
+{
+	if (!release_pack_mapping(img.data)) UnloadImage(img);
+}
+
+INLINE static size_t get_img_bytes(const Image *img)
+{
+	return (size_t) img->width*img->height*pixel_format_to_amount_of_bytes(img->format);
+}
+
+// Mipmaps add a third on top of the base level
+INLINE static size_t get_texture_bytes(const Texture2D *texture)
+{
+	return (size_t) texture->width*texture->height*4/3*4;
+}
+
+// Adds (`sign` 1) or removes (`sign` -1) the pixels of a preview to the count of their category
+static void count_preview_img(const Image *img, int sign)
+{
+	if (img->data == NULL) return;
+
+	const size_t bytes = get_img_bytes(img);
+	auto &count = pixel_bytes[is_pack_mapped(img->data) ? PIXELS_PACKED : PIXELS_DECODED];
+	if (sign > 0) count += bytes;
+	else count -= bytes;
+}
+
+INLINE static size_t get_memory_cap(void)
+{
+	static const size_t cap = getenv_size(MEMORY_ENV, DEFAULT_MEMORY_MB)*MB;
+	return cap;
+}
+
+INLINE static bool is_over_memory_cap(void)
+{
+	return pixel_bytes[PIXELS_DECODED] + pixel_bytes[PIXELS_PACKED] + pixel_bytes[PIXELS_COMPRESSED] > get_memory_cap();
+}
 
-	const double curr_time = GetTime();
-	Vector2 mouse_pos = GetMousePosition();
+INLINE static size_t get_texture_cap(void)
+{
+	static const size_t cap = getenv_size(TEXTURE_ENV, DEFAULT_TEXTURE_MB)*MB;
+	return cap;
+}
+
+INLINE static bool is_over_texture_cap(void)
+{
+	return pixel_bytes[PIXELS_TEXTURES] > get_texture_cap();
+}
+
+// Frees whatever a preview holds on to, placeholders share theirs
+static void release_preview(img_value_t *value)
+{
+	if (value->is_placeholder) return;
+
+	count_preview_img(&value->scaled_img, -1);
+	unload_preview_img(value->scaled_img);
+	value->scaled_img.data = NULL;
+
+	if (value->qoi != NULL) {
+		pixel_bytes[PIXELS_COMPRESSED] -= value->qoi_size;
+		MemFree(value->qoi);
+		value->qoi = NULL;
+	}
+
+	if (value->loaded_texture) {
+		pixel_bytes[PIXELS_TEXTURES] -= get_texture_bytes(&*value->loaded_texture);
+		UnloadTexture(*value->loaded_texture);
+		value->loaded_texture = std::nullopt;
+	}
+}
+
+static void close_pack(pack_t *p)
+{
+	if (p->fd != -1) close(p->fd);
+	if (p->map != NULL) retire_pack_mapping(p->map);
+	p->fd = -1;
+	p->map = NULL;
+	p->growing = false;
+	p->lazy = false;
+	p->map_size = 0;
+	p->count = 0;
+	p->capacity = 0;
+	p->slots.clear();
+}
+
+static bool map_pack(pack_t *p)
+{
+	void *map = mmap(NULL, p->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, 0);
+	if (map == MAP_FAILED) return false;
+
+	p->map = (uint8_t *) map;
+
+	std::lock_guard<std::mutex> lock(pack_mappings_mtx);
+	pack_mappings[(uintptr_t) map] = (pack_mapping_t) {
+		.size = p->map_size,
+		.refs = 0,
+		.retired = false,
+	};
+	return true;
+}
+
+// Creates an empty pack at `p->file_path` with room for `capacity` entries, copying over the ones of `old` if there is one
+static bool create_pack(pack_t *p, uint32_t capacity, const pack_t *old)
+{
+	const std::string tmp_path = p->file_path + "." + std::to_string((long) syscall(SYS_gettid)) + ".tmp";
+	const int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1) return false;
+
+	const size_t file_size = get_pack_file_size(p->box_w, p->box_h, capacity);
+	pack_header_t header = {
+		.magic = {0},
+		.box_w = p->box_w,
+		.box_h = p->box_h,
+		.capacity = capacity,
+		.count = old != NULL ? old->count : 0,
+	};
+	memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+
+	bool ok = ftruncate(fd, file_size) == 0 && pwrite(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header);
+
+	if (ok && old != NULL && old->count > 0) {
+		const size_t index_bytes = (size_t) old->count*sizeof(pack_entry_t);
+		const size_t blob_bytes = (size_t) old->count*get_pack_blob_size(p->box_w, p->box_h);
+		ok = pwrite(fd, get_pack_entry(old, 0), index_bytes, sizeof(header)) == (ssize_t) index_bytes &&
+				 pwrite(fd, get_pack_blob(old, 0), blob_bytes, get_pack_index_size(capacity)) == (ssize_t) blob_bytes;
+	}
+
+	if (!ok || rename(tmp_path.c_str(), p->file_path.c_str()) == -1) {
+		close(fd);
+		unlink(tmp_path.c_str());
+		return false;
+	}
+
+	p->fd = fd;
+	p->map_size = file_size;
+	p->capacity = capacity;
+	p->count = header.count;
+
+	if (!map_pack(p)) {
+		close_pack(p);
+		return false;
+	}
+
+	return true;
+}
+
+static bool open_existing_pack(pack_t *p)
+{
+	p->fd = open(p->file_path.c_str(), O_RDWR | O_CLOEXEC);
+	if (p->fd == -1) return false;
+
+	pack_header_t header = {};
+	struct stat info = {};
+	if (pread(p->fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)
+	||  memcmp(header.magic, PACK_MAGIC, sizeof(header.magic)) != 0
+	||  header.box_w != p->box_w
+	||  header.box_h != p->box_h
+	||  header.count > header.capacity
+	||  fstat(p->fd, &info) == -1
+	||  (size_t) info.st_size < get_pack_file_size(p->box_w, p->box_h, header.capacity))
+	{
+		close_pack(p);
+		return false;
+	}
+
+	p->capacity = header.capacity;
+	p->count = header.count;
+	p->map_size = get_pack_file_size(p->box_w, p->box_h, header.capacity);
+
+	if (!map_pack(p)) {
+		close_pack(p);
+		return false;
+	}
+
+	for (uint32_t i = 0; i < p->count; ++i) {
+		const pack_entry_t *e = get_pack_entry(p, i);
+		if (e->width != 0) p->slots[e->ino] = i;
+	}
+
+	return true;
+}
+
+INLINE static std::string get_packs_dir(void)
+{
+	return get_cache_dir() + "/fe/packs";
+}
+
+// Makes `pack` the one of `dir` at the current tile size, runs on the loader thread at the start of every pass,
+// an existing pack is opened, a new one is only made once there's something to put into it
+static void ensure_dir_pack(const char *dir)
+{
+	static const bool enabled = getenv_flag(THUMBNAIL_PACK_ENV, true);
+	if (!enabled) return;
+
+	// One pack per thumbnail flavor, tiles of every scale it covers share it
+	const uint32_t box_w = get_thumbnail_flavor(tile_box_size)->size;
+	const uint32_t box_h = box_w;
+
+	std::lock_guard<std::mutex> lock(pack_mtx);
+	if (pack.dir == dir && pack.box_w == box_w && pack.box_h == box_h) return;
+
+	close_pack(&pack);
+	pack.dir = dir;
+	pack.box_w = box_w;
+	pack.box_h = box_h;
+	pack.file_path.clear();
+
+	char abs_dir[PATH_MAX];
+	if (get_cache_dir().empty() || realpath(dir, abs_dir) == NULL) return;
+
+	char md5[33];
+	md5_hex(abs_dir, strlen(abs_dir), md5);
+
+	pack.file_path = get_packs_dir() + "/" + md5 + "-" + std::to_string(box_w) + "x" + std::to_string(box_h) + ".pack";
+
+	if (!open_existing_pack(&pack)) pack.lazy = true;
+}
+
+// Looks `ino` up in the pack of `dir`, the returned image points into the mapping,
+// `*thumb_size` is the flavor the pack is of
+static bool load_from_pack(const char *dir, size_t ino, timespec mtim, size_t size, Image *img, int *thumb_size)
+{
+	std::lock_guard<std::mutex> lock(pack_mtx);
+	if (pack.fd == -1 || pack.dir != dir) return false;
+
+	auto it = pack.slots.find(ino);
+	if (it == pack.slots.end()) return false;
+
+	const pack_entry_t *e = get_pack_entry(&pack, it->second);
+	if (e->ino != ino
+	||  e->mtime_sec != mtim.tv_sec
+	||  e->mtime_nsec != mtim.tv_nsec
+	||  e->size != size
+	||  e->width == 0 || e->width > pack.box_w
+	||  e->height == 0 || e->height > pack.box_h)
+	{
+		return false;
+	}
+
+	*img = (Image) {
+		.data = get_pack_blob(&pack, it->second),
+		.width = (int) e->width,
+		.height = (int) e->height,
+		.mipmaps = 1,
+		.format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+	};
+	*thumb_size = pack.box_w;
+	acquire_pack_mapping(img->data);
+	return true;
+}
+
+// Copies the full `pack` into one twice its size, without holding `pack_mtx` through the copy, which can be
+// a gigabyte at the biggest flavor, `lock` is the caller's lock of it, false if `pack` should be left alone
+static bool grow_pack(std::unique_lock<std::mutex> &lock)
+{
+	// What the copy reads from, the reference keeps the mapping around even if the pack is closed meanwhile
+	pack_t old = {};
+	old.fd = -1;
+	old.map = pack.map;
+	old.box_w = pack.box_w;
+	old.box_h = pack.box_h;
+	old.capacity = pack.capacity;
+	old.count = pack.count;
+
+	pack_t grown = {};
+	grown.dir = pack.dir;
+	grown.file_path = pack.file_path;
+	grown.box_w = pack.box_w;
+	grown.box_h = pack.box_h;
+	grown.fd = -1;
+
+	pack.growing = true;
+	acquire_pack_mapping(old.map);
+
+	lock.unlock();
+	const bool ok = create_pack(&grown, old.capacity*2, &old);
+	lock.lock();
+
+	// The directory or the flavor changed meanwhile, what was written is a good pack all the same
+	const bool same = pack.map == old.map;
+	release_pack_mapping(old.map);
+
+	if (!same) {
+		close_pack(&grown);
+		return false;
+	}
+
+	pack.growing = false;
+	if (!ok) return false;
+
+	grown.slots = std::move(pack.slots);
+	close_pack(&pack);
+	pack = std::move(grown);
+	return true;
+}
+
+// Adds or refreshes the entry of `ino` in the pack of `dir`, `scaled` has to be of flavor `thumb_size`,
+// which is only stored in a pack of that flavor, a job queued before a zoom may finish after the pack changed
+static void store_in_pack(const char *dir, const struct stat *info, int thumb_size, const Image *scaled)
+{
+	std::unique_lock<std::mutex> lock(pack_mtx);
+	if (pack.dir != dir || pack.growing) return;
+	if ((uint32_t) thumb_size != pack.box_w) return;
+	if ((uint32_t) scaled->width > pack.box_w || (uint32_t) scaled->height > pack.box_h) return;
+
+	if (pack.fd == -1) {
+		if (!pack.lazy) return;
+
+		// Only ever tried once per pack
+		pack.lazy = false;
+		mkdir(get_cache_dir().c_str(), 0700);
+		mkdir((get_cache_dir() + "/fe").c_str(), 0700);
+		mkdir(get_packs_dir().c_str(), 0700);
+		if (!create_pack(&pack, PACK_INITIAL_CAPACITY, NULL)) return;
+	}
+
+	// A refreshed entry goes into a fresh slot too, an image handed out of the old one may still be uploading,
+	// the old one is only marked unused
+	if (pack.count == pack.capacity && !grow_pack(lock)) return;
+	const uint32_t slot = pack.count;
+
+	Image rgba = ImageCopy(*scaled);
+	ImageFormat(&rgba, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+	memcpy(get_pack_blob(&pack, slot), rgba.data, (size_t) rgba.width*rgba.height*4);
+	UnloadImage(rgba);
+
+	pack_entry_t *e = get_pack_entry(&pack, slot);
+	*e = (pack_entry_t) {
+		.ino = info->st_ino,
+		.mtime_sec = info->st_mtim.tv_sec,
+		.mtime_nsec = info->st_mtim.tv_nsec,
+		.size = (uint64_t) info->st_size,
+		.width = (uint32_t) scaled->width,
+		.height = (uint32_t) scaled->height,
+	};
+
+	pack.count++;
+	((pack_header_t *) pack.map)->count = pack.count;
+
+	auto it = pack.slots.find(info->st_ino);
+	if (it != pack.slots.end()) get_pack_entry(&pack, it->second)->width = 0;
+
+	pack.slots[info->st_ino] = slot;
+}
+
+INLINE static bool tile_is_match(size_t tile_idx)
+{
+	for (const auto &idx: matched_idxs) {
+		if (tile_idx == idx) return true;
+	}
+	return false;
+}
+
+// Counts the frames `render_files` has drawn
+static uint64_t render_frame = 0;
+
+// Scrub strips, most recently used first, only touched by the main thread
+typedef struct {
+	size_t ino;
+	Texture2D texture;
+	int frame_w;
+	int frame_h;
+	int frames;
+	float scale;
+	size_t bytes;
+} scrub_strip_t;
+
+static std::list<scrub_strip_t> scrub_strips = {};
+static size_t scrub_strips_bytes = 0;
+
+// The tile under the mouse as of the last frame, and since when it's been there
+static size_t scrub_hover_idx = (size_t) -1;
+static size_t scrub_hover_ino = (size_t) -1;
+static double scrub_hover_time = 0.0;
+static bool scrub_hover_requested = false;
+
+INLINE static size_t get_scrub_cache_cap(void)
+{
+	static const size_t cap = getenv_size(SCRUB_CACHE_ENV, DEFAULT_SCRUB_CACHE_MB)*MB;
+	return cap;
+}
+
+static void drop_scrub_strip(std::list<scrub_strip_t>::iterator it)
+{
+	scrub_strips_bytes -= it->bytes;
+	UnloadTexture(it->texture);
+	scrub_strips.erase(it);
+}
+
+// Moves the strip of `ino` to the front, strips made for tiles of another size are thrown away
+static const scrub_strip_t *find_scrub_strip(size_t ino)
+{
+	for (auto it = scrub_strips.begin(); it != scrub_strips.end(); ++it) {
+		if (it->ino != ino) continue;
+
+		if (it->scale != scale) {
+			drop_scrub_strip(it);
+			return NULL;
+		}
+
+		scrub_strips.splice(scrub_strips.begin(), scrub_strips, it);
+		return &scrub_strips.front();
+	}
+	return NULL;
+}
+
+// With mipmaps and trilinear filtering, so previews stay smooth however far the tiles shrink them
+static Texture2D load_preview_texture(Image img)
+{
+	Texture2D texture = LoadTextureFromImage(img);
+	GenTextureMipmaps(&texture);
+	SetTextureFilter(texture, TEXTURE_FILTER_TRILINEAR);
+	return texture;
+}
+
+// Only the texture is drawn after that, the pixels can be had again from the pack or the file
+static size_t upload_preview(img_value_t *value)
+{
+	const Texture2D texture = load_preview_texture(value->scaled_img);
+	value->loaded_texture = texture;
+	pixel_bytes[PIXELS_TEXTURES] += get_texture_bytes(&texture);
+
+	count_preview_img(&value->scaled_img, -1);
+	unload_preview_img(value->scaled_img);
+	value->scaled_img.data = NULL;
+
+	return get_texture_bytes(&texture);
+}
+
+// The frame of `strip` at `progress` (0 to 1) across the tile, centered like the preview it stands in for
+static void draw_scrub_frame(const scrub_strip_t *strip, const Vector2 *tile_pos, float progress)
+{
+	const int n = std::clamp((int) (progress*strip->frames), 0, strip->frames - 1);
+	const Rectangle src = {
+		(float) (n % SCRUB_COLUMNS)*strip->frame_w,
+		(float) (n / SCRUB_COLUMNS)*strip->frame_h,
+		(float) strip->frame_w,
+		(float) strip->frame_h,
+	};
+
+	const Vector2 pos = {
+		tile_pos->x + text_padding + (tile_width  - strip->frame_w - 2*text_padding) / 2,
+		tile_pos->y + text_padding + (tile_height - strip->frame_h - 2*text_padding) / 2,
+	};
+
+	DrawTextureRec(strip->texture, src, pos, WHITE);
+}
+
+static void render_files(void)
+{
+	const int tpr = get_tiles_per_row();
+	if (tpr == 0) return;
+
+	std::lock_guard<std::mutex> lock(img_map_mtx);
+	render_frame++;
+
+	const Vector2 mouse_pos = GetMousePosition();
+	scrub_hover_idx = (size_t) -1;
 
 	for (size_t i = 0; i < paths.size(); ++i) {
 		if (paths[i].deleted) continue;
@@ -1130,641 +5115,1156 @@ static void handle_mouse_input(void)
 		const int tile_pos_y = i / tpr;
 
 		const Vector2 tile_pos = get_tile_pos(tile_pos_x, tile_pos_y);
-		const Rectangle tile_rect = get_tile_rect(&tile_pos);
 
-		if (!CheckCollisionPointRec(mouse_pos, tile_rect)) continue;
-		if ((curr_time - last_click_time) <= DOUBLE_CLICK_THRESHOLD
-		&& CheckCollisionPointRec(last_click_pos, tile_rect))
+		if (tile_pos.y + tile_height < 0
+		|| tile_pos.y > GetScreenHeight())
 		{
-			char *tmp = join_dir(paths[i].str);
-			switch (paths[i].type) {
-			case DT_DIR: {
-				enter_dir(tmp, i);
-				last_click_time = 0.0;
-			} break;
+			continue;
+		}
 
-			case DT_REG: {
-				handle_enter(tmp);
-			} break;
+		Color tile_color = TILE_COLOR;
 
-			default: break;
-			}
+		if (selected_tile_pos.x == tile_pos_x
+		&&  selected_tile_pos.y == tile_pos_y)
+		{
+			tile_color = CLICKED_TILE_COLOR;
+		} else if (tile_is_match(i)) {
+			tile_color = MATCHED_TILE_COLOR;
 		}
 
-		last_click_pos = mouse_pos;
-		last_click_time = curr_time;
-		selected_tile_pos.x = tile_pos_x;
-		selected_tile_pos.y = tile_pos_y;
-		break;
+		DrawRectangleV(tile_pos,
+		              (Vector2) {
+		                (float) tile_width,
+								    (float) tile_height
+		              },
+								  tile_color);
+
+		if (selected_tile_pos.x == tile_pos_x
+		&&	selected_tile_pos.y == tile_pos_y)
+		{
+			const Rectangle tile_rect =	get_tile_rect(&tile_pos);
+			draw_text_boxed(font, paths[i].str, tile_rect, true, WHITE);
+		} else {
+			const Rectangle tile_rect = get_tile_rect(&tile_pos);
+			const bool hovered = CheckCollisionPointRec(mouse_pos, tile_rect);
+			if (hovered) scrub_hover_idx = i;
+
+			const size_t idx = hmgeti(img_map, paths[i].ino);
+			img_map[idx].value.last_drawn = render_frame;
+
+			Texture2D texture = {0};
+			if (img_map[idx].value.loaded_texture) {
+				texture = *img_map[idx].value.loaded_texture;
+			} else {
+				// Still QOI encoded, or waiting for its turn in `upload_previews`
+				texture = placeholder_texture;
+			}
+
+			// Previews are as big as their flavor, the GPU shrinks them into the tile
+			int draw_w, draw_h;
+			fit_size(texture.width, texture.height, tile_width - text_padding, tile_height - text_padding, &draw_w, &draw_h);
+
+			const float centered_x = tile_pos.x			+
+															 text_padding		+
+															 (tile_width		-
+																draw_w				-
+																2*text_padding) / 2;
+
+			const float centered_y = tile_pos.y			 +
+															 text_padding		 +
+															 (tile_height		 -
+																draw_h				 -
+																2*text_padding) / 2;
+
+			const scrub_strip_t *strip = hovered && !img_map[idx].value.is_placeholder ? find_scrub_strip(paths[i].ino) : NULL;
+			if (strip != NULL) {
+				draw_scrub_frame(strip, &tile_pos, (mouse_pos.x - tile_rect.x) / tile_rect.width);
+			} else {
+				const Rectangle src = {0, 0, (float) texture.width, (float) texture.height};
+				const Rectangle dst = {centered_x, centered_y, (float) draw_w, (float) draw_h};
+				DrawTexturePro(texture, src, dst, (Vector2) {0, 0}, 0.0f, WHITE);
+			}
+
+			const Vector2 text_pos = get_text_pos(&tile_pos);
+			draw_text_truncated(paths[i].str, text_pos, tile_width - 2*text_padding, WHITE);
+
+			if (paths[i].type == DT_DIR) draw_dir_size(paths[i].ino, &tile_pos);
+		}
 	}
 }
 
-static void draw_text_truncated(const char *text,
-																Vector2 pos,
-																float max_text_width,
-																Color color)
+INLINE static Image scale_img(Image src_img)
 {
-	const float text_width = MeasureTextEx(font, text, font_size, text_spacing).x;
+	return copy_resized_img(&src_img, tile_width - text_padding, tile_height - text_padding);
+}
 
-	if (text_width > max_text_width) {
-		int len = strlen(text);
-		char truncated[MAX_PATH_SIZE] = {0};
-		strncpy(truncated, text, sizeof(truncated));
+static void handle_dropped_files(void)
+{
+	FilePathList files = LoadDroppedFiles();
+	for (size_t i = 0; i < files.count; i++) {
+		struct stat info = {0};
+		stat(files.paths[i], &info);
+
+		char *top_level_file_path = get_top_file_path(files.paths[i]);
+
+		scratch_buffer_clear();
+		scratch_buffer_append(top_level_file_path);
+		char *top_level_file_path_copy = scratch_buffer_copy();
+
+		Nob_Cmd cmd = {0};
+		nob_cmd_append(&cmd, "cp", files.paths[i], top_level_file_path);
+
+		uint8_t type = 0;
+		if (S_ISDIR(info.st_mode)) {
+			type = DT_DIR;
+			nob_cmd_append(&cmd, "-r");
+		} else if (S_ISREG(info.st_mode)) {
+			type = DT_REG;
+		} else {
+			eprintf("naah bruh");
+			continue;
+		}
+
+		Nob_Proc proc = nob_cmd_run_async(cmd, true);
+		procs.emplace_back(proc);
+
+		path_t path = new_path(top_level_file_path_copy,
+													 &info,
+													 type,
+													 true);
+
+		scratch_buffer_clear();
+		scratch_buffer_append(files.paths[i]);
 
-		while (MeasureTextEx(font, truncated, font_size, text_spacing).x +
-					 MeasureTextEx(font, "...", font_size, text_spacing).x > max_text_width
-			&& len > 0)
 		{
-			truncated[--len] = '\0';
+			std::lock_guard<std::mutex> lock(paths_mtx);
+			paths.emplace_back(path);
+			path.str = scratch_buffer_copy();
+			to_load.emplace_back(path);
 		}
 
-		strcat(truncated, "...");
-		DrawTextEx(font, truncated, pos, font_size, text_spacing, color);
-	} else {
-		DrawTextEx(font, text, pos, font_size, text_spacing, color);
+		img_value_t value = {
+			.scaled_img = scale_img(placeholder_scaled),
+			.is_placeholder = true,
+			.loaded_texture = std::nullopt,
+		};
+
+		std::lock_guard<std::mutex> lock(img_map_mtx);
+		hmput(img_map, path.ino, value);
 	}
-}
 
-static void draw_text_boxed_selectable(Font font,
-																			 const char *text,
-																			 Rectangle rec,
-																			 bool word_wrap,
-																			 Color tint,
-																			 int selectStart,
-																			 int selectLength,
-																			 Color selectTint,
-																			 Color selectBackTint)
-{
-	int length = TextLength(text);
+	// Only once the placeholders are in, the loader skips entries without one
+	wake_loader();
 
-	float textOffsetY = 0;
-	float textOffsetX = 0.0f;
+	UnloadDroppedFiles(files);
+}
 
-	float scaleFactor = font_size / (float) font.baseSize;
+// `paths` index of a dropped file, which goes before anything else
+#define DECODE_IDX_URGENT ((size_t) -2)
+// Tile of a prefetched directory, which goes after everything else
+#define DECODE_IDX_PREFETCH ((size_t) -1)
 
-	enum { MEASURE_STATE = 0, DRAW_STATE = 1 };
-	int state = word_wrap? MEASURE_STATE : DRAW_STATE;
+static void load_preview_image(size_t ino, size_t idx, size_t gen, char *file_path);
+static bool should_defer_preview(size_t idx);
 
-	int startLine = -1;
-	int endLine = -1;
-	int lastk = -1;
+// Directory part of a `file_path` made by `get_path_to_load`
+INLINE static std::string get_parent_dir(const char *file_path)
+{
+	const char *slash = strrchr(file_path, '/');
+	return slash == NULL ? std::string(".") : std::string(file_path, slash - file_path);
+}
 
-	for (int i = 0, k = 0; i < length; i++, k++) {
-		int codepointByteCount = 0;
-		int codepoint = GetCodepoint(&text[i], &codepointByteCount);
-		int index = GetGlyphIndex(font, codepoint);
+// Whether an entry still needs a preview: it has none yet, or tiles have grown past the flavor of the one it has
+INLINE static bool wants_preview(const img_value_t *value)
+{
+	if (value->evicted) return false;
+	return value->is_placeholder || (value->thumb_size != 0 && value->thumb_size < tile_box_size);
+}
 
-		if (codepoint == 0x3f) codepointByteCount = 1;
-		i += (codepointByteCount - 1);
+static void load_preview(size_t paths_idx, path_t path, size_t gen, bool rescale, char *file_path)
+{
+	// Before `img_map_mtx`, the two are never held at once
+	const bool defer = !rescale && should_defer_preview(paths_idx);
 
-		float glyphWidth = 0;
-		if (codepoint != '\n') {
-			glyphWidth = (font.glyphs[index].advanceX == 0) ?
-				font.recs[index].width*scaleFactor :
-				font.glyphs[index].advanceX*scaleFactor;
+	std::unique_lock<std::mutex> lock(img_map_mtx);
 
-			if (i + 1 < length) glyphWidth = glyphWidth + text_spacing;
-		}
+	int idx = hmgeti(img_map, path.ino);
+	if (idx < 0) return;
 
-		if (state == MEASURE_STATE) {
-			if ((codepoint == ' ') || (codepoint == '\t') || (codepoint == '\n')) endLine = i;
-			if ((textOffsetX + glyphWidth) > rec.width) {
-				endLine = (endLine < 1)? i : endLine;
-				if (i == endLine) endLine -= codepointByteCount;
-				if ((startLine + codepointByteCount) == endLine) endLine = (i - codepointByteCount);
+	if (rescale) {
+		img_map_t *p = hmgetp(img_map, path.ino);
 
-				state = !state;
-			} else if ((i + 1) == length) {
-				endLine = i;
-				state = !state;
-			}
-			else if (codepoint == '\n') state = !state;
-			if (state == DRAW_STATE) {
-				textOffsetX = 0;
-				i = startLine;
-				glyphWidth = 0;
+		if (img_map[idx].value.is_placeholder) {
+			UnloadImage(placeholder_scaled);
+			to_unload.emplace_back(placeholder_texture);
 
-				int tmp = lastk;
-				lastk = k - 1;
-				k = tmp;
-			}
+			placeholder_scaled = scale_img(placeholder_src);
+			placeholder_resized = true;
+			return;
 		}
-		else {
-			if (codepoint == '\n') {
-				if (!word_wrap) {
-					textOffsetY += (font.baseSize + font.baseSize/2)*scaleFactor;
-					textOffsetX = 0;
-				}
-			}
-			else {
-				if (!word_wrap && ((textOffsetX + glyphWidth) > rec.width)) {
-					textOffsetY += (font.baseSize + font.baseSize/2)*scaleFactor;
-					textOffsetX = 0;
-				}
-
-				if ((textOffsetY + font.baseSize*scaleFactor) > rec.height) break;
-
-				bool isGlyphSelected = false;
-				if ((selectStart >= 0)
-				&& (k >= selectStart)
-				&& (k < (selectStart + selectLength)))
-				{
-					DrawRectangleRec((Rectangle) {
-														 rec.x + textOffsetX - 1,
-														 rec.y + textOffsetY,
-														 glyphWidth,
-														 (float)font.baseSize*scaleFactor
-													 },
-													 selectBackTint);
-					isGlyphSelected = true;
-				}
 
-				if ((codepoint != ' ') && (codepoint != '\t')) {
-					DrawTextCodepoint(font, codepoint,
-														(Vector2){rec.x + textOffsetX, rec.y + textOffsetY},
-														font_size,
-														isGlyphSelected? selectTint : tint);
-				}
-			}
+		// The GPU fits previews into tiles of any size, only tiles that outgrew the flavor need a bigger one,
+		// the current one stays up until it's there
+		if (!wants_preview(&p->value)) return;
 
-			if (word_wrap && (i == endLine)) {
-				textOffsetY += (font.baseSize + font.baseSize/2)*scaleFactor;
-				textOffsetX = 0;
-				startLine = endLine;
-				endLine = -1;
-				glyphWidth = 0;
-				selectStart += lastk - k;
-				k = lastk;
+		lock.unlock();
+		load_preview_image(path.ino, paths_idx, gen, file_path);
+		return;
+	}
 
-				state = !state;
-			}
+	const bool is_placeholder = img_map[idx].value.is_placeholder;
+	lock.unlock();
+
+	// With the metadata from the listing, a hit in the pack doesn't even need the decoders,
+	// the lookup faults in pages of the pack, which must not happen with `img_map_mtx` held
+	Image img = {0};
+	int thumb_size = 0;
+	if (path.has_meta && !path.abs && paths_idx < DECODE_IDX_URGENT && gen == preview_gen
+	&&  is_placeholder
+	&&  !defer
+	&&  load_from_pack(get_parent_dir(file_path).c_str(), path.ino, path.mtim, path.size, &img, &thumb_size))
+	{
+		lock.lock();
+
+		// The main thread may have put something else in meanwhile
+		img_map_t *p = hmgetp_null(img_map, path.ino);
+		if (p == NULL || !p->value.is_placeholder || gen != preview_gen) {
+			unload_preview_img(img);
+			return;
 		}
 
-		if ((textOffsetX != 0) || (codepoint != ' ')) textOffsetX += glyphWidth;
+		img_value_t value = {
+			.scaled_img = img,
+			.is_placeholder = false,
+			.loaded_texture = std::nullopt,
+			.thumb_size = thumb_size,
+		};
+		count_preview_img(&value.scaled_img, 1);
+		hmput(img_map, path.ino, value);
+		return;
 	}
-}
 
-INLINE static void draw_text_boxed(Font font,
-																	 const char *text,
-																	 Rectangle rec,
-																	 bool word_wrap,
-																	 Color tint)
-{
-	draw_text_boxed_selectable(font, text, rec, word_wrap, tint, 0, 0, WHITE, WHITE);
+	// Dropped files live somewhere else, they don't belong in the pack either
+	load_preview_image(path.ino, path.abs ? DECODE_IDX_URGENT : paths_idx, gen, file_path);
 }
 
-static uint8_t *load_first_frame(const char *file_path, Mat *frame)
+typedef struct {
+	size_t ino;
+	size_t idx;
+	size_t gen;
+	uint64_t rank;
+	std::string file_path;
+	// `tile_box_size` when it was queued, which picks the thumbnail flavor
+	int box_size;
+	// Makes the scrub strip of a video instead of its preview, fit into `strip_w`x`strip_h`,
+	// the size of the tiles at `scale` when it was queued
+	bool scrub;
+	int strip_w;
+	int strip_h;
+	float scale;
+	// A copy of the QOI encoded preview to unpack, instead of decoding the file
+	std::vector<uint8_t> qoi;
+} decode_job_t;
+
+typedef struct {
+	size_t ino;
+	size_t gen;
+	bool ok;
+	float scale;
+	int thumb_size;
+	// The frames of a scrub strip, in a grid of `SCRUB_COLUMNS`
+	Image sheet;
+	Image scaled_img;
+	bool scrub;
+	int frame_w;
+	int frame_h;
+	int frames;
+	// `scaled_img` was unpacked from the QOI of the preview in the img map
+	bool unpacked;
+	uint8_t *qoi;
+	int qoi_size;
+} decode_result_t;
+
+// Communication with the decoder pool, guarded by `decode_mtx`,
+// `decode_inflight` maps the inos that are queued or decoded but not yet in the img map to their generation
+static std::mutex decode_mtx;
+static std::condition_variable decode_cv;
+static std::vector<decode_job_t> decode_jobs = {};
+static std::vector<decode_result_t> decode_results = {};
+static std::unordered_map<size_t, size_t> decode_inflight = {};
+// Inos whose scrub strip is queued or being made
+static std::unordered_set<size_t> scrub_inflight = {};
+
+INLINE static void finish_inflight(size_t ino, size_t gen)
 {
-	VideoCapture cap = VideoCapture(file_path);
-	if (!cap.isOpened()) {
-		eprintf("could not open video file.\n");
-		return NULL;
-	}
-
-	if (!cap.read(*frame)) {
-		eprintf("could not read the first frame.\n");
-		return NULL;
-	}
-
-	uint8_t *data = (uint8_t*) malloc(frame->rows*frame->cols*3);
-	Mat buf = Mat(frame->rows, frame->cols, CV_8UC3, data);
-
-	cvtColor(*frame, buf, COLOR_BGR2RGB);
-	buf.release();
-	cap.release();
-	return data;
+	auto it = decode_inflight.find(ino);
+	if (it != decode_inflight.end() && it->second == gen) decode_inflight.erase(it);
 }
 
-static void resize_img(Image *img, int tw, int th)
+INLINE static void finish_job(const decode_job_t &job)
 {
-	const int w = img->width;
-	const int h = img->height;
+	if (job.scrub) scrub_inflight.erase(job.ino);
+	else finish_inflight(job.ino, job.gen);
+}
 
-	const float original_aspect = (float) w / h;
-	const float target_aspect = (float) tw / th;
+// `paths` indices of the tiles on screen, guarded by `decode_mtx` too
+static size_t decode_vis_first = 0;
+static size_t decode_vis_last = 0;
 
-	int nw, nh;
-	if (original_aspect > target_aspect) {
-		nw = tw;
-		nh = tw / original_aspect;
+// Lower goes first: the tiles on screen, then the next screenful, then the previous one, then the rest by distance
+static uint64_t get_decode_rank(size_t idx)
+{
+	if (idx == DECODE_IDX_URGENT) return 0;
+	if (idx == DECODE_IDX_PREFETCH) return UINT64_MAX;
+
+	const size_t first = decode_vis_first;
+	const size_t last = decode_vis_last;
+	const size_t screen = last - first;
+
+	uint64_t tier = 0, dist = 0;
+	if (idx >= first && idx < last) {
+		tier = 1;
+		dist = idx - first;
+	} else if (idx >= last && idx - last < screen) {
+		tier = 2;
+		dist = idx - last;
+	} else if (idx < first && first - idx <= screen) {
+		tier = 3;
+		dist = first - idx;
 	} else {
-		nh = th;
-		nw = th*original_aspect;
+		tier = 4;
+		dist = idx < first ? first - idx : idx - last;
 	}
 
-	ImageResize(img, nw, nh);
+	return (tier << 48) | dist;
 }
 
-INLINE static void resize_img_to_size_of_tile(Image *img)
+// `decode_jobs` is a heap with the lowest rank on top
+INLINE static bool decode_job_cmp(const decode_job_t &a, const decode_job_t &b)
 {
-	resize_img(img, tile_width - text_padding, tile_height - text_padding);
+	return a.rank > b.rank;
 }
 
-INLINE static bool is_png_file(const char *file_path)
+// Re-ranks the queued jobs whenever the tiles on screen change, because of scrolling or resizing
+static void update_decode_priorities(void)
 {
-	std::ifstream file(file_path, std::ios::binary);
-	if (!file.is_open()) return false;
-	char buf[8] = {0};
-	file.read(buf, 8);
-	return file.gcount() == 8 && memcmp(buf, PNG_MAGIC_BYTES, 8) == 0;
-}
+	const int tpr = get_tiles_per_row();
+	const size_t first_visible_row = scroll_offset_y / (tile_height + tile_spacing);
+	const size_t first = first_visible_row*tpr;
+	const size_t last = (first_visible_row + get_tiles_per_col() + 1)*tpr;
 
-INLINE static bool is_mp3_file(const char *file_path)
-{
-	TagLib::FileRef file = TagLib::FileRef(file_path);
-	if (file.isNull()) return false;
-	TagLib::AudioProperties *props = file.audioProperties();
-	return props != NULL && props->bitrate() > 0 && props->sampleRate() > 0 && props->channels() > 0;
-}
+	std::lock_guard<std::mutex> lock(decode_mtx);
+	if (first == decode_vis_first && last == decode_vis_last) return;
 
-INLINE static bool is_mp4_file(const char *file_path)
-{
-	std::ifstream file(file_path, std::ios::binary);
-	if (!file.is_open()) return false;
-	char buf[8] = {0};
-	file.read(buf, 8);
-	return file.gcount() == 8 && memcmp(buf + 4, MP4_MAGIC_BYTES, 4) == 0;
+	decode_vis_first = first;
+	decode_vis_last = last;
+
+	for (auto &job: decode_jobs) job.rank = get_decode_rank(job.idx);
+	std::make_heap(decode_jobs.begin(), decode_jobs.end(), decode_job_cmp);
 }
 
-INLINE static bool is_image(char *file_path)
+// Whether `idx` is within a screenful of the tiles on screen, needs `decode_mtx`
+INLINE static bool is_near_screen(size_t idx)
 {
-	char *ext = get_extension(file_path);
-	return _is_image(ext) || is_png_file(file_path);
+	const size_t screen = decode_vis_last - decode_vis_first;
+	return idx + screen >= decode_vis_first && idx < decode_vis_last + screen;
 }
 
-INLINE static bool is_music(char *file_path)
+// Over the memory cap, only the tiles around the screen get their previews, the rest waits until it's scrolled to
+static bool should_defer_preview(size_t idx)
 {
-	char *ext = get_extension(file_path);
-	return _is_music(ext) || is_mp3_file(file_path);
+	if (idx == DECODE_IDX_URGENT || !is_over_memory_cap()) return false;
+	if (idx == DECODE_IDX_PREFETCH) return true;
+
+	std::lock_guard<std::mutex> lock(decode_mtx);
+	return !is_near_screen(idx);
 }
 
-INLINE static bool is_video(char *file_path)
+// Hands the preview of `file_path` over to the decoder pool, unless `ino` has a preview that's big enough already,
+// `idx` is where it is in `paths`, so it can be prioritized, `gen` is the `preview_gen` it was picked up in
+static void load_preview_image(size_t ino, size_t idx, size_t gen, char *file_path)
 {
-	char *ext = get_extension(file_path);
-	return _is_video(ext) || is_mp4_file(file_path);
+	if (gen != preview_gen) return;
+
+	const bool defer = should_defer_preview(idx);
+
+	{
+		std::lock_guard<std::mutex> lock(img_map_mtx);
+		img_map_t *p = hmgetp_null(img_map, ino);
+		if (p == NULL || !wants_preview(&p->value)) return;
+
+		if (defer && p->value.is_placeholder) {
+			p->value.evicted = true;
+			return;
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(decode_mtx);
+		auto it = decode_inflight.find(ino);
+		if (it != decode_inflight.end() && it->second == gen) return;
+		decode_inflight[ino] = gen;
+
+		decode_jobs.push_back((decode_job_t) {
+			.ino = ino,
+			.idx = idx,
+			.gen = gen,
+			.rank = get_decode_rank(idx),
+			.file_path = file_path,
+			.box_size = tile_box_size,
+			.scrub = false,
+		});
+		std::push_heap(decode_jobs.begin(), decode_jobs.end(), decode_job_cmp);
+	}
+	decode_cv.notify_one();
 }
 
-static void handle_enter(char *file_path_)
+// Swaps the pixels of `img` for their QOI encoding, which is about a third to a fifth of their size,
+// QOI only knows RGB and RGBA, anything else is kept as it is
+static bool compress_preview_img(Image *img, uint8_t **qoi, int *qoi_size)
 {
-	scratch_buffer_append_full_file_path(get_top_file_path(file_path_));
-	char *file_path = scratch_buffer_to_string();
-	if (is_video(file_path) || is_music(file_path)) {
-		Nob_Cmd cmd = {0};
-		nob_cmd_append(&cmd, "mpv", file_path);
-		const Nob_Proc proc = nob_cmd_run_async(cmd, true);
-		procs.emplace_back(proc);
-	} else if (is_image(file_path)) {
-		Nob_Cmd cmd = {0};
-		nob_cmd_append(&cmd, "mpv", "--loop", file_path);
-		const Nob_Proc proc = nob_cmd_run_async(cmd, true);
-		procs.emplace_back(proc);
-	}
+	if (img->format != PIXELFORMAT_UNCOMPRESSED_R8G8B8 && img->format != PIXELFORMAT_UNCOMPRESSED_R8G8B8A8) return false;
+
+	int size = 0;
+	uint8_t *data = ExportImageToMemory(*img, ".qoi", &size);
+	if (data == NULL) return false;
+
+	UnloadImage(*img);
+	img->data = NULL;
+	*qoi = data;
+	*qoi_size = size;
+	return true;
 }
 
-static uint8_t *try_get_album_cover(const char *file_path, size_t *data_size)
+// A decoder thread, decodes and scales on its own, the results are put into the img map by the main thread
+static void decode_previews(void)
 {
-	MPEG::File file = MPEG::File(file_path);
-	ID3v2::Tag *id3v2_tag = file.ID3v2Tag();
+	std::vector<char> file_path(PATH_MAX);
 
-	if (!id3v2_tag) return NULL;
-	const auto &frames = id3v2_tag->frameListMap()["APIC"];
-	if (frames.isEmpty()) return NULL;
+	std::unique_lock<std::mutex> lock(decode_mtx);
+	while (true) {
+		decode_cv.wait(lock, [] { return stop_flag || !decode_jobs.empty(); });
+		if (stop_flag) break;
 
-	const auto *picture_frame = (ID3v2::AttachedPictureFrame *) (frames.front());
-	if (!picture_frame) return NULL;
+		std::pop_heap(decode_jobs.begin(), decode_jobs.end(), decode_job_cmp);
+		decode_job_t job = std::move(decode_jobs.back());
+		decode_jobs.pop_back();
 
-	const ByteVector &image_data = picture_frame->picture();
-	const size_t size = image_data.size();
-	*data_size = size;
+		if (job.gen != preview_gen) {
+			finish_job(job);
+			continue;
+		}
 
-	uint8_t *data = (uint8_t*) malloc(size);
-	memcpy(data, image_data.data(), size);
+		// Previews that won't be on screen anytime soon wait in the img map QOI encoded
+		const bool far = job.idx < DECODE_IDX_URGENT && !is_near_screen(job.idx);
+
+		lock.unlock();
+
+		decode_job_gen = job.gen;
+
+		if (!job.qoi.empty()) {
+			decode_result_t result = {
+				.ino = job.ino,
+				.gen = job.gen,
+				.ok = false,
+				.scale = job.scale,
+				.thumb_size = 0,
+				.sheet = {0},
+				.scaled_img = LoadImageFromMemory(".qoi", job.qoi.data(), job.qoi.size()),
+				.scrub = false,
+				.frame_w = 0,
+				.frame_h = 0,
+				.frames = 0,
+				.unpacked = true,
+			};
+			result.ok = result.scaled_img.data != NULL;
+
+			lock.lock();
+			if (result.gen != preview_gen) {
+				if (result.ok) UnloadImage(result.scaled_img);
+				finish_inflight(result.ino, result.gen);
+				continue;
+			}
 
-	return data;
-}
+			decode_results.push_back(result);
+			continue;
+		}
 
-static int comp_to_pixel_format(int comp)
-{
-	switch (comp) {
-	case 1:	 return PIXELFORMAT_UNCOMPRESSED_GRAYSCALE;
-	case 2:	 return PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA;
-	case 3:	 return PIXELFORMAT_UNCOMPRESSED_R8G8B8;
-	case 4:	 return PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
-	default: return -1;
+		snprintf(file_path.data(), file_path.size(), "%s", job.file_path.c_str());
+
+		if (job.scrub) {
+			decode_result_t result = {
+				.ino = job.ino,
+				.gen = job.gen,
+				.ok = false,
+				.scale = job.scale,
+				.thumb_size = 0,
+				.sheet = {0},
+				.scaled_img = {0},
+				.scrub = true,
+				.frame_w = 0,
+				.frame_h = 0,
+				.frames = 0,
+			};
+
+			result.ok = is_video(file_path.data()) &&
+									load_video_strip(file_path.data(),
+																	 job.strip_w,
+																	 job.strip_h,
+																	 &result.sheet,
+																	 &result.frame_w,
+																	 &result.frame_h,
+																	 &result.frames);
+
+			lock.lock();
+			if (result.gen != preview_gen) {
+				if (result.ok) UnloadImage(result.sheet);
+				scrub_inflight.erase(result.ino);
+				continue;
+			}
+
+			decode_results.push_back(result);
+			continue;
+		}
+
+		// Only entries of the current directory go into its pack
+		const bool packable = job.idx < DECODE_IDX_URGENT;
+		const std::string dir = packable ? get_parent_dir(file_path.data()) : std::string();
+
+		struct stat info = {};
+		const bool is_file = stat(file_path.data(), &info) == 0 && S_ISREG(info.st_mode);
+
+		decode_result_t result = {
+			.ino = job.ino,
+			.gen = job.gen,
+			.ok = false,
+			.scale = job.scale,
+			.thumb_size = 0,
+			.sheet = {0},
+			.scaled_img = {0},
+			.scrub = false,
+			.frame_w = 0,
+			.frame_h = 0,
+			.frames = 0,
+		};
+
+		// Previews stay at the size of their flavor, the GPU fits them into the tile
+		if (packable && is_file && load_from_pack(dir.c_str(), job.ino, info.st_mtim, info.st_size, &result.scaled_img, &result.thumb_size)) {
+			result.ok = true;
+		} else {
+			result.ok = get_cached_preview(file_path.data(), is_file ? &info : NULL, job.box_size, &result.scaled_img, &result.thumb_size);
+			if (result.ok && decode_cancelled()) {
+				UnloadImage(result.scaled_img);
+				result.ok = false;
+			}
+
+			if (result.ok && packable && is_file) store_in_pack(dir.c_str(), &info, result.thumb_size, &result.scaled_img);
+		}
+
+		// What came out of the pack is in the page cache already, only decoded pixels are worth encoding
+		if (result.ok && far && !is_pack_mapped(result.scaled_img.data)) {
+			compress_preview_img(&result.scaled_img, &result.qoi, &result.qoi_size);
+		}
+
+		lock.lock();
+
+		// Nobody wants it anymore, don't bother the main thread with it
+		if (result.gen != preview_gen) {
+			if (result.ok) unload_preview_img(result.scaled_img);
+			MemFree(result.qoi);
+			finish_inflight(result.ino, result.gen);
+			continue;
+		}
+
+		decode_results.push_back(result);
 	}
-	__builtin_unreachable();
 }
 
-static bool get_preview(char *file_path, Image *img)
+// Drops the queued jobs of the directory we just left, the ones being decoded stop at their next safe point
+static void cancel_previews(void)
 {
-	if (is_video(file_path)) {
-		Mat frame = {};
-		uint8_t *data = load_first_frame(file_path, &frame);
+	std::lock_guard<std::mutex> lock(decode_mtx);
 
-		img->data = data;
-		img->width = frame.cols;
-		img->height = frame.rows;
-		img->mipmaps = 1;
-		img->format = PIXELFORMAT_UNCOMPRESSED_R8G8B8;
-
-		frame.release();
+	const size_t gen = preview_gen;
+	auto it = std::remove_if(decode_jobs.begin(), decode_jobs.end(), [gen](const decode_job_t &job) {
+		if (job.gen == gen) return false;
+		finish_job(job);
 		return true;
-	} else if (is_music(file_path)) {
-		size_t data_size = 0;
-		uint8_t *data = try_get_album_cover(file_path, &data_size);
-
-		if (data == NULL || data_size == 0) return false;
-
-		int comp = 0;
-		img->data = stbi_load_from_memory(data,
-																			data_size,
-																			&img->width,
-																			&img->height,
-																			&comp,
-																			0);
-
-		if (img->data == NULL) {
-			free(data);
-			return false;
-		}
+	});
 
-		int format = comp_to_pixel_format(comp);
-		if (format == -1) {
-			free(img->data);
-			return false;
-		}
+	decode_jobs.erase(it, decode_jobs.end());
+	std::make_heap(decode_jobs.begin(), decode_jobs.end(), decode_job_cmp);
+}
 
-		img->format = format;
-		img->mipmaps = 1;
-		return true;
-	} else if (is_image(file_path)) {
-		FILE *stream = fopen(file_path, "rb");
-		if (!stream) {
-			eprintf("failed to open %s\n", file_path);
-			return false;
+// Cores we may actually run on: the affinity mask, capped by the cgroup CPU quota if there is one
+static size_t get_available_cpus(void)
+{
+	size_t cpus = std::max(std::thread::hardware_concurrency(), 1u);
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) cpus = std::max(CPU_COUNT(&set), 1);
+
+	long long quota = -1, period = 0;
+
+	FILE *f = fopen("/sys/fs/cgroup/cpu.max", "r");
+	if (f != NULL) {
+		// cgroup v2, "max 100000" when there's no limit
+		if (fscanf(f, "%lld %lld", &quota, &period) != 2) quota = -1;
+		fclose(f);
+	} else if ((f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")) != NULL) {
+		if (fscanf(f, "%lld", &quota) != 1) quota = -1;
+		fclose(f);
+
+		f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+		if (f != NULL) {
+			if (fscanf(f, "%lld", &period) != 1) period = 0;
+			fclose(f);
 		}
+	}
 
-		int comp = 0;
-		img->data = stbi_load_from_file(stream,
-																		&img->width,
-																		&img->height,
-																		&comp,
-																		0);
+	if (quota > 0 && period > 0) {
+		cpus = std::min(cpus, (size_t) std::max((quota + period - 1) / period, 1LL));
+	}
 
-		if (img->data == NULL) {
-			eprintf("failed to load image from %s\n", file_path);
-			fclose(stream);
-			return false;
-		}
+	return cpus;
+}
 
-		int format = comp_to_pixel_format(comp);
-		if (format == -1) {
-			free(img->data);
-			fclose(stream);
-			return false;
-		}
+static std::vector<std::thread> start_decoders(void)
+{
+	install_map_fault_handler();
 
-		img->format = format;
-		img->mipmaps = 1;
+	const size_t count = std::max(getenv_size(DECODE_THREADS_ENV, get_available_cpus()), (size_t) 1);
 
-		fclose(stream);
-		return true;
+	std::vector<std::thread> decoders = {};
+	for (size_t i = 0; i < count; ++i) {
+		decoders.emplace_back(decode_previews);
 	}
 
-	return false;
+	return decoders;
 }
 
-INLINE static bool tile_is_match(size_t tile_idx)
+static void cache_scrub_strip(decode_result_t *r)
 {
-	for (const auto &idx: matched_idxs) {
-		if (tile_idx == idx) return true;
+	const size_t bytes = (size_t) r->sheet.width*r->sheet.height*3;
+	const size_t cap = get_scrub_cache_cap();
+	if (r->scale != scale || bytes > cap) {
+		UnloadImage(r->sheet);
+		return;
 	}
-	return false;
+
+	for (auto it = scrub_strips.begin(); it != scrub_strips.end(); ++it) {
+		if (it->ino == r->ino) {
+			drop_scrub_strip(it);
+			break;
+		}
+	}
+
+	// Only the texture is kept, a strip is only ever drawn
+	scrub_strips.push_front((scrub_strip_t) {
+		.ino = r->ino,
+		.texture = LoadTextureFromImage(r->sheet),
+		.frame_w = r->frame_w,
+		.frame_h = r->frame_h,
+		.frames = r->frames,
+		.scale = r->scale,
+		.bytes = bytes,
+	});
+	scrub_strips_bytes += bytes;
+	UnloadImage(r->sheet);
+
+	while (scrub_strips_bytes > cap) drop_scrub_strip(std::prev(scrub_strips.end()));
 }
 
-static void render_files(void)
+// Asks the decoder pool for the scrub strip of the video under the mouse, once it has rested there for a bit
+// and the tile has its preview, runs on the main thread every frame
+static void poll_scrub_hover(void)
 {
-	const int tpr = get_tiles_per_row();
-	if (tpr == 0) return;
-
-	for (size_t i = 0; i < paths.size(); ++i) {
-		if (paths[i].deleted) continue;
+	if (scrub_hover_idx >= paths.size()) {
+		scrub_hover_ino = (size_t) -1;
+		return;
+	}
 
-		const int tile_pos_x = i % tpr;
-		const int tile_pos_y = i / tpr;
+	const path_t &path = paths[scrub_hover_idx];
+	if (path.ino != scrub_hover_ino) {
+		scrub_hover_ino = path.ino;
+		scrub_hover_time = GetTime();
+		scrub_hover_requested = false;
+		return;
+	}
 
-		const Vector2 tile_pos = get_tile_pos(tile_pos_x, tile_pos_y);
+	if (scrub_hover_requested || path.type == DT_DIR || GetTime() - scrub_hover_time < SCRUB_HOVER_DELAY) return;
+	scrub_hover_requested = true;
 
-		if (tile_pos.y + tile_height < 0
-		|| tile_pos.y > GetScreenHeight())
-		{
-			continue;
+	{
+		std::lock_guard<std::mutex> lock(img_map_mtx);
+		const img_map_t *p = hmgetp_null(img_map, path.ino);
+		if (p == NULL || p->value.is_placeholder) {
+			// Not yet, ask again once it's there
+			scrub_hover_requested = false;
+			return;
 		}
+	}
 
-		Color tile_color = TILE_COLOR;
+	if (find_scrub_strip(path.ino) != NULL) return;
+
+	// Whether it's a video at all is up to the decoder, sniffing it here would read the file on the main thread
+	char *file_path = path.abs ? path.str : join_dir(path.str);
+
+	{
+		std::lock_guard<std::mutex> lock(decode_mtx);
+		if (!scrub_inflight.insert(path.ino).second) return;
+
+		decode_jobs.push_back((decode_job_t) {
+			.ino = path.ino,
+			.idx = DECODE_IDX_URGENT,
+			.gen = preview_gen,
+			.rank = get_decode_rank(DECODE_IDX_URGENT),
+			.file_path = file_path,
+			.box_size = tile_box_size,
+			.scrub = true,
+			.strip_w = tile_width - text_padding,
+			.strip_h = tile_height - text_padding,
+			.scale = scale,
+		});
+		std::push_heap(decode_jobs.begin(), decode_jobs.end(), decode_job_cmp);
+	}
+	decode_cv.notify_one();
+}
 
-		if (selected_tile_pos.x == tile_pos_x
-		&&  selected_tile_pos.y == tile_pos_y)
-		{
-			tile_color = CLICKED_TILE_COLOR;
-		} else if (tile_is_match(i)) {
-			tile_color = MATCHED_TILE_COLOR;
-		}
+// Whether a preview of flavor `thumb_size` is an improvement over what `value` has
+INLINE static bool is_better_preview(const img_value_t *value, int thumb_size)
+{
+	if (value->is_placeholder) return true;
+	if (value->thumb_size == 0) return false;
+	return thumb_size == 0 || thumb_size > value->thumb_size;
+}
 
-		DrawRectangleV(tile_pos,
-		              (Vector2) {
-		                (float) tile_width,
-								    (float) tile_height
-		              },
-								  tile_color);
+// Puts whatever the decoders have finished into the img map, runs on the main thread every frame
+static void poll_decoded_previews(void)
+{
+	std::vector<decode_result_t> results = {};
+	{
+		std::lock_guard<std::mutex> lock(decode_mtx);
+		if (decode_results.empty()) return;
+		results.swap(decode_results);
+	}
 
-		if (selected_tile_pos.x == tile_pos_x
-		&&	selected_tile_pos.y == tile_pos_y)
-		{
-			const Rectangle tile_rect =	get_tile_rect(&tile_pos);
-			draw_text_boxed(font, paths[i].str, tile_rect, true, WHITE);
-		} else {
-			const size_t idx = hmgeti(img_map, paths[i].ino);
-			Texture2D texture = {0};
-			if (img_map[idx].value.loaded_texture) {
-				texture = *img_map[idx].value.loaded_texture;
-			} else if (img_map[idx].value.is_placeholder) {
-				texture = placeholder_texture;
-			} else {
-				texture = LoadTextureFromImage(img_map[idx].value.scaled_img);
-				img_map[idx].value.loaded_texture = texture;
+	{
+		std::lock_guard<std::mutex> lock(img_map_mtx);
+		for (auto &r: results) {
+			if (!r.ok) continue;
+
+			if (r.scrub) {
+				cache_scrub_strip(&r);
+				continue;
 			}
 
-			const float centered_x = tile_pos.x			+
-															 text_padding		+
-															 (tile_width		-
-																texture.width -
-																2*text_padding) / 2;
+			img_map_t *p = hmgetp_null(img_map, r.ino);
 
-			const float centered_y = tile_pos.y			 +
-															 text_padding		 +
-															 (tile_height		 -
-																texture.height -
-																2*text_padding) / 2;
+			// Only if the QOI it came from is still there, the preview could have been replaced meanwhile
+			if (r.unpacked) {
+				if (p == NULL || r.gen != preview_gen || p->value.qoi == NULL) {
+					UnloadImage(r.scaled_img);
+					continue;
+				}
 
-			DrawTexture(texture, centered_x, centered_y, WHITE);
+				pixel_bytes[PIXELS_COMPRESSED] -= p->value.qoi_size;
+				MemFree(p->value.qoi);
+				p->value.qoi = NULL;
 
-			const Vector2 text_pos = get_text_pos(&tile_pos);
-			draw_text_truncated(paths[i].str, text_pos, tile_width - 2*text_padding, WHITE);
+				p->value.scaled_img = r.scaled_img;
+				count_preview_img(&p->value.scaled_img, 1);
+				continue;
+			}
+
+			if (p == NULL || r.gen != preview_gen || !is_better_preview(&p->value, r.thumb_size)) {
+				unload_preview_img(r.scaled_img);
+				MemFree(r.qoi);
+				continue;
+			}
+
+			// A bigger flavor replacing the one the tiles outgrew
+			release_preview(&p->value);
+
+			img_value_t value = {
+				.scaled_img = r.scaled_img,
+				.is_placeholder = false,
+				.loaded_texture = std::nullopt,
+				.thumb_size = r.thumb_size,
+				.evicted = false,
+				.last_drawn = 0,
+				.qoi = r.qoi,
+				.qoi_size = r.qoi_size,
+			};
+
+			count_preview_img(&value.scaled_img, 1);
+			if (value.qoi != NULL) pixel_bytes[PIXELS_COMPRESSED] += value.qoi_size;
+			hmput(img_map, r.ino, value);
 		}
 	}
+
+	// Only now, so the loader can't queue an ino again between the two
+	std::lock_guard<std::mutex> lock(decode_mtx);
+	for (const auto &r: results) {
+		if (r.scrub) scrub_inflight.erase(r.ino);
+		else finish_inflight(r.ino, r.gen);
+	}
 }
 
-INLINE static Image scale_img(Image src_img)
+// Has the decoders unpack the QOI encoded preview of `ino`, they get a copy so the img map can drop it anytime
+static void unpack_preview(size_t ino, size_t idx)
 {
-	Image scaled_img = src_img;
-	scaled_img.data = copy_img_data(&src_img);
-	resize_img_to_size_of_tile(&scaled_img);
-	return scaled_img;
+	const size_t gen = preview_gen;
+	{
+		std::lock_guard<std::mutex> lock(decode_mtx);
+		auto it = decode_inflight.find(ino);
+		if (it != decode_inflight.end() && it->second == gen) return;
+	}
+
+	std::vector<uint8_t> qoi = {};
+	{
+		std::lock_guard<std::mutex> lock(img_map_mtx);
+		const img_map_t *p = hmgetp_null(img_map, ino);
+		if (p == NULL || p->value.qoi == NULL) return;
+		qoi.assign(p->value.qoi, p->value.qoi + p->value.qoi_size);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(decode_mtx);
+		auto it = decode_inflight.find(ino);
+		if (it != decode_inflight.end() && it->second == gen) return;
+		decode_inflight[ino] = gen;
+
+		decode_jobs.push_back((decode_job_t) {
+			.ino = ino,
+			.idx = idx,
+			.gen = gen,
+			.rank = get_decode_rank(idx),
+			.file_path = "",
+			.scrub = false,
+			.qoi = std::move(qoi),
+		});
+		std::push_heap(decode_jobs.begin(), decode_jobs.end(), decode_job_cmp);
+	}
+	decode_cv.notify_one();
 }
 
-static void handle_dropped_files(void)
+// Hands the evicted tiles that came close to the screen back to the decoders, and has them unpack the QOI encoded ones
+static void reload_near_previews(size_t first, size_t last)
 {
-	FilePathList files = LoadDroppedFiles();
-	for (size_t i = 0; i < files.count; i++) {
-		struct stat info = {0};
-		stat(files.paths[i], &info);
+	std::vector<size_t> idxs = {};
+	std::vector<size_t> packed_idxs = {};
+	{
+		std::lock_guard<std::mutex> lock(img_map_mtx);
+		for (size_t i = first; i < last && i < paths.size(); ++i) {
+			if (paths[i].deleted) continue;
 
-		char *top_level_file_path = get_top_file_path(files.paths[i]);
+			img_map_t *p = hmgetp_null(img_map, paths[i].ino);
+			if (p == NULL) continue;
 
-		scratch_buffer_clear();
-		scratch_buffer_append(top_level_file_path);
-		char *top_level_file_path_copy = scratch_buffer_copy();
+			if (p->value.qoi != NULL) {
+				packed_idxs.push_back(i);
+			} else if (p->value.evicted) {
+				p->value.evicted = false;
+				idxs.push_back(i);
+			}
+		}
+	}
 
-		Nob_Cmd cmd = {0};
-		nob_cmd_append(&cmd, "cp", files.paths[i], top_level_file_path);
+	for (const auto &i: packed_idxs) unpack_preview(paths[i].ino, i);
 
-		uint8_t type = 0;
-		if (S_ISDIR(info.st_mode)) {
-			type = DT_DIR;
-			nob_cmd_append(&cmd, "-r");
-		} else if (S_ISREG(info.st_mode)) {
-			type = DT_REG;
+	char file_path[PATH_MAX] = {0};
+	for (const auto &i: idxs) {
+		if (paths[i].abs) {
+			snprintf(file_path, PATH_MAX, "%s", paths[i].str);
 		} else {
-			eprintf("naah bruh");
-			continue;
+			snprintf(file_path, PATH_MAX, "%s/%s", curr_dir, paths[i].str);
 		}
+		load_preview_image(paths[i].ino, i, preview_gen, file_path);
+	}
+}
 
-		Nob_Proc proc = nob_cmd_run_async(cmd, true);
-		procs.emplace_back(proc);
+typedef struct {
+	size_t ino;
+	bool textured;
+	bool elsewhere;
+	uint64_t last_drawn;
+	size_t dist;
+} eviction_t;
+
+// Whether `a` goes before `b`: other directories first, then the least recently drawn, then the farthest from the screen
+INLINE static bool eviction_cmp(const eviction_t &a, const eviction_t &b)
+{
+	if (a.elsewhere != b.elsewhere) return a.elsewhere;
+	if (a.last_drawn != b.last_drawn) return a.last_drawn < b.last_drawn;
+	return a.dist > b.dist;
+}
 
-		path_t path = new_path(top_level_file_path_copy,
-													 &info,
-													 type,
-													 true);
+// Drops the img map entries of other directories that have nothing but a placeholder,
+// listing a directory makes them again
+static void sweep_img_map(void)
+{
+	std::unordered_set<size_t> inos = {};
+	inos.reserve(paths.size());
+	for (const auto &path: paths) inos.insert(path.ino);
 
-		paths.emplace_back(path);
+	for (long i = hmlen(img_map) - 1; i >= 0; --i) {
+		if (img_map[i].value.is_placeholder && inos.count(img_map[i].key) == 0) hmdel(img_map, img_map[i].key);
+	}
+}
 
-		scratch_buffer_clear();
-		scratch_buffer_append(files.paths[i]);
+// Throws away previews until what's left fits under the memory and texture caps, those of the tiles
+// around the screen are kept, whatever is thrown away from the current directory is loaded again
+// once it gets close to the screen, the rest is forgotten
+static void evict_previews(size_t first, size_t last)
+{
+	std::lock_guard<std::mutex> lock(img_map_mtx);
 
-		path.str = scratch_buffer_copy();
+	if ((size_t) hmlen(img_map) > paths.size() + IMG_MAP_SLACK) sweep_img_map();
 
-		to_load.emplace_back(path);
-		idle_flag = false;
+	const bool over_memory = is_over_memory_cap();
+	const bool over_textures = is_over_texture_cap();
+	if (!over_memory && !over_textures) return;
 
-		img_value_t value = {
-			.src_img = placeholder_src,
-			.scaled_img = scale_img(placeholder_scaled),
-			.is_placeholder = true,
-			.loaded_texture = std::nullopt,
+	// Only previews count against the caps, and only about as many of them as fit under those are around
+	std::unordered_map<size_t, eviction_t> candidates = {};
+	for (long i = 0; i < hmlen(img_map); ++i) {
+		const img_value_t *value = &img_map[i].value;
+		if (value->is_placeholder) continue;
+
+		const bool textured = value->loaded_texture.has_value();
+		if (textured ? !over_textures : (!over_memory || (value->scaled_img.data == NULL && value->qoi == NULL))) continue;
+
+		candidates[img_map[i].key] = (eviction_t) {
+			.ino = img_map[i].key,
+			.textured = textured,
+			.elsewhere = true,
+			.last_drawn = value->last_drawn,
+			.dist = SIZE_MAX,
 		};
+	}
 
-		hmput(img_map, path.ino, value);
+	for (size_t i = 0; i < paths.size() && !candidates.empty(); ++i) {
+		auto it = candidates.find(paths[i].ino);
+		if (it == candidates.end()) continue;
+
+		if (i >= first && i < last) {
+			candidates.erase(it);
+		} else {
+			it->second.elsewhere = false;
+			it->second.dist = i < first ? first - i : i - last + 1;
+		}
 	}
 
-	UnloadDroppedFiles(files);
+	std::vector<eviction_t> victims = {};
+	victims.reserve(candidates.size());
+	for (const auto &[ino, victim]: candidates) victims.push_back(victim);
+	std::sort(victims.begin(), victims.end(), eviction_cmp);
+
+	for (const auto &victim: victims) {
+		if (!(victim.textured ? is_over_texture_cap() : is_over_memory_cap())) continue;
+
+		img_map_t *p = hmgetp(img_map, victim.ino);
+		release_preview(&p->value);
+
+		if (victim.elsewhere) {
+			hmdel(img_map, victim.ino);
+		} else {
+			p->value = placeholder_img;
+			p->value.evicted = true;
+		}
+	}
 }
 
-static void load_preview(size_t i, path_t path, size_t size)
+static void print_memory_stats(void)
 {
-	bool prev_scale_flag = new_scale_flag;
-	if (i == size - 1) {
-		if (new_scale_flag) new_scale_flag = false;
-		idle_flag = true;
-	}
+	static size_t last[PIXELS_CATEGORIES + 1] = {};
+	const size_t curr[PIXELS_CATEGORIES + 1] = {
+		pixel_bytes[PIXELS_DECODED],
+		pixel_bytes[PIXELS_PACKED],
+		pixel_bytes[PIXELS_COMPRESSED],
+		pixel_bytes[PIXELS_TEXTURES],
+		scrub_strips_bytes,
+	};
+	if (memcmp(last, curr, sizeof(curr)) == 0) return;
+	memcpy(last, curr, sizeof(curr));
 
-	int idx = hmgeti(img_map, path.ino);
+	eprintf("[memory] decoded %.1f MB, packed %.1f MB, qoi %.1f MB, textures %.1f MB, scrub strips %.1f MB, caps %zu/%zu MB\n",
+	        (double) curr[0] / MB, (double) curr[1] / MB, (double) curr[2] / MB, (double) curr[3] / MB, (double) curr[4] / MB,
+	        get_memory_cap() / MB, get_texture_cap() / MB);
+}
 
-	if (prev_scale_flag) {
-		img_map_t *p = hmgetp(img_map, path.ino);
+// Uploads the previews that are waiting for it, the tiles on screen first, then the next screenful,
+// then the previous one, for as long as the frame's budget lasts, runs on the main thread every frame
+static void upload_previews(void)
+{
+	size_t first = 0, last = 0;
+	{
+		std::lock_guard<std::mutex> lock(decode_mtx);
+		first = decode_vis_first;
+		last = decode_vis_last;
+	}
 
-		if (img_map[idx].value.is_placeholder) {
-			UnloadImage(placeholder_scaled);
-			to_unload.emplace_back(placeholder_texture);
+	const size_t screen = last - first;
+	const size_t ranges[][2] = {
+		{first, last},
+		{last, last + screen},
+		{first > screen ? first - screen : 0, first},
+	};
 
-			placeholder_scaled = scale_img(placeholder_src);
-			placeholder_resized = true;
-			return;
-		}
+	const auto start = std::chrono::steady_clock::now();
+	size_t bytes = 0;
 
-		if (p->value.scaled_img.data != NULL) {
-			UnloadImage(p->value.scaled_img);
-		}
+	std::lock_guard<std::mutex> lock(img_map_mtx);
+	for (const auto &range: ranges) {
+		for (size_t i = range[0]; i < range[1] && i < paths.size(); ++i) {
+			if (paths[i].deleted) continue;
 
-		p->value.scaled_img = scale_img(p->value.src_img);
+			img_map_t *p = hmgetp_null(img_map, paths[i].ino);
+			if (p == NULL
+			||  p->value.is_placeholder
+			||  p->value.loaded_texture
+			||  p->value.scaled_img.data == NULL)
+			{
+				continue;
+			}
 
-		if (p->value.loaded_texture) {
-			to_unload.emplace_back(*p->value.loaded_texture);
+			if (bytes > 0 && (bytes >= UPLOAD_BUDGET_MB*MB || get_ms_since(start) >= UPLOAD_BUDGET_MS)) return;
+			bytes += upload_preview(&p->value);
 		}
+	}
+}
 
-		p->value.loaded_texture = std::nullopt;
-		return;
-	} else if (!img_map[idx].value.is_placeholder) return;
+// Keeps the preview pixels under the memory cap, runs on the main thread every frame
+static void poll_memory(void)
+{
+	static const bool stats = getenv_flag(MEMORY_STATS_ENV);
+	static double last_evict = 0.0;
+	static double last_stats = 0.0;
+
+	size_t first = 0, last = 0;
+	{
+		std::lock_guard<std::mutex> lock(decode_mtx);
+		const size_t screen = decode_vis_last - decode_vis_first;
+		first = decode_vis_first > screen ? decode_vis_first - screen : 0;
+		last = decode_vis_last + screen;
+	}
 
-	scratch_buffer_clear();
-	if (!path.abs) {
-		scratch_buffer_append(curr_dir);
-		scratch_buffer_append_char('/');
+	reload_near_previews(first, last);
+
+	const double now = GetTime();
+	if (now - last_evict >= MEMORY_EVICT_INTERVAL) {
+		last_evict = now;
+		evict_previews(first, last);
 	}
 
-	scratch_buffer_append(path.str);
+	if (stats && now - last_stats >= MEMORY_STATS_INTERVAL) {
+		last_stats = now;
+		print_memory_stats();
+	}
+}
 
-	char *file_path = scratch_buffer_to_string();
+// Previews of a prefetched directory, only while the current directory has nothing left to load
+static void load_prefetched_previews(char *file_path)
+{
+	while (idle_flag && !stop_flag) {
+		size_t ino = 0;
+		size_t gen = 0;
+		{
+			std::lock_guard<std::mutex> lock(paths_mtx);
+			if (prefetch_to_load.empty()) return;
+			gen = preview_gen;
+			ino = prefetch_to_load.back().ino;
+			snprintf(file_path, PATH_MAX, "%s", prefetch_to_load.back().file_path.c_str());
+			prefetch_to_load.pop_back();
+		}
 
-	Image src_img = {0};
-	if (!get_preview(file_path, &src_img)) return;
+		load_preview_image(ino, DECODE_IDX_PREFETCH, gen, file_path);
+	}
+}
 
-	Image scaled_img = src_img;
-	scaled_img.data = copy_img_data(&src_img);
+// Copies the `i`th entry of `list` along with its full path and the generation of the listing, so that
+// the loader doesn't hold on to `paths_mtx` while decoding
+static bool get_path_to_load(const std::vector<path_t> &list,
+														 size_t i,
+														 path_t *path,
+														 size_t *gen,
+														 char *file_path)
+{
+	std::lock_guard<std::mutex> lock(paths_mtx);
+	if (i >= list.size()) return false;
 
-	resize_img_to_size_of_tile(&scaled_img);
+	*path = list[i];
+	*gen = preview_gen;
 
-	img_value_t value = {
-		.src_img = src_img,
-		.scaled_img = scaled_img,
-		.is_placeholder = false,
-		.loaded_texture = std::nullopt,
-	};
+	if (path->abs) {
+		snprintf(file_path, PATH_MAX, "%s", path->str);
+	} else {
+		snprintf(file_path, PATH_MAX, "%s/%s", curr_dir, path->str);
+	}
 
-	hmput(img_map, path.ino, value);
-	return;
+	return true;
 }
 
 static void load_previews(void)
 {
-	while (!stop_flag) {
-		if (idle_flag) continue;
+	char file_path[PATH_MAX] = {0};
 
-		for (int i = to_load.size() - 1; i >= 0; --i) {
-			if (idle_flag) break;
-			if (to_load[i].deleted) continue;
-			load_preview(i, to_load[i], to_load.size());
-			to_load.pop_back();
+	while (true) {
+		size_t wakes = 0;
+		bool rescale = false;
+		{
+			std::unique_lock<std::mutex> lock(loader_mtx);
+			loader_cv.wait(lock, [] { return stop_flag || !idle_flag || loader_prefetch_ready; });
+			if (stop_flag) break;
+
+			if (idle_flag) {
+				loader_prefetch_ready = false;
+				lock.unlock();
+				load_prefetched_previews(file_path);
+				continue;
+			}
+
+			wakes = loader_wakes;
+			rescale = new_scale_flag;
+			new_scale_flag = false;
 		}
 
-		for (size_t i = 0; i < paths.size(); ++i) {
+		{
+			std::unique_lock<std::mutex> lock(paths_mtx);
+			const std::string dir = curr_dir;
+			lock.unlock();
+			ensure_dir_pack(dir.c_str());
+		}
+
+		path_t path = {0};
+		size_t gen = 0;
+
+		while (!idle_flag) {
+			size_t last = 0;
+			{
+				std::lock_guard<std::mutex> lock(paths_mtx);
+				if (to_load.empty()) break;
+				last = to_load.size() - 1;
+			}
+
+			if (!get_path_to_load(to_load, last, &path, &gen, file_path)) break;
+			if (!path.deleted) load_preview(DECODE_IDX_URGENT, path, gen, rescale, file_path);
+
+			std::lock_guard<std::mutex> lock(paths_mtx);
+			if (!to_load.empty()) to_load.pop_back();
+		}
+
+		for (size_t i = 0; get_path_to_load(paths, i, &path, &gen, file_path); ++i) {
 			if (idle_flag) break;
-			if (paths[i].deleted) continue;
-			load_preview(i, paths[i], paths.size());
+			if (path.deleted) continue;
+			load_preview(i, path, gen, rescale, file_path);
 		}
 
-		std::this_thread::sleep_for(std::chrono::milliseconds(PREVIEW_LOADER_SLEEP_TIME));
+		// Anything that came up during the pass gets another one
+		std::lock_guard<std::mutex> lock(loader_mtx);
+		if (loader_wakes == wakes) idle_flag = true;
 	}
 }
 
@@ -1775,8 +6275,8 @@ INLINE static uint8_t is_dir(const char *file_path)
 	return S_ISDIR(info.st_mode);
 }
 
-// fill img map with placeholder textures
-static void fill_img_map(bool init)
+// (re)create the placeholder values that `fill_img_map` puts into the img map
+static void refresh_placeholder_imgs(bool init)
 {
 	#define X DECLARE_SCALED_IMG
 	XPLACEHOLDERS
@@ -1795,8 +6295,27 @@ static void fill_img_map(bool init)
 	#define X INIT_IMG_VALUE
 	XPLACEHOLDERS
 	#undef X
+}
+
+// fill img map with placeholder textures, for `list[from..to)`,
+// `keep_loaded` leaves entries that are already in the map alone
+static void fill_img_map_of(const std::vector<path_t> &list, size_t from, size_t to, bool keep_loaded)
+{
+	const img_value_t img = placeholder_img;
+	const img_value_t dir_img = dir_placeholder_img;
+	const img_value_t music_img = music_placeholder_img;
+
+	std::lock_guard<std::mutex> lock(img_map_mtx);
+
+	for (size_t i = from; i < to; ++i) {
+		const path_t &path = list[i];
+
+		img_map_t *p = hmgetp_null(img_map, path.ino);
+		if (p != NULL) {
+			if (keep_loaded) continue;
+			release_preview(&p->value);
+		}
 
-	for (const auto &path: paths) {
 		scratch_buffer_clear();
 		scratch_buffer_append(path.str);
 		char *ext = get_extension(scratch_buffer_to_string());
@@ -1810,9 +6329,10 @@ static void fill_img_map(bool init)
 			continue;
 		}
 
-		scratch_buffer_append_full_file_path(get_top_file_path(path.str));
-
-		if (is_music(scratch_buffer_to_string())) {
+		// Only look at the extension here, sniffing the contents of every file
+		// would cost a file open per entry before the first frame,
+		// the preview loader takes a closer look anyway
+		if (_is_music(ext)) {
 			hmput(img_map, path.ino, music_img);
 		}	else if (path.type == DT_DIR) {
 			hmput(img_map, path.ino, dir_img);
@@ -1822,8 +6342,18 @@ static void fill_img_map(bool init)
 	}
 }
 
+static void fill_img_map(size_t from, bool keep_loaded)
+{
+	fill_img_map_of(paths, from, paths.size(), keep_loaded);
+}
+
 int main(const int argc, char *argv[])
 {
+	if (argc > 1 && streq(argv[1], BENCH_DOWNSCALE_FLAG)) {
+		bench_downscale();
+		return 0;
+	}
+
 	SetTargetFPS(60);
 	SetConfigFlags(FLAG_WINDOW_RESIZABLE);
 	InitWindow(1000, 600, "fe");
@@ -1837,8 +6367,6 @@ int main(const int argc, char *argv[])
 
 	memory_init(3);
 
-	read_dir();
-
 	placeholder_src				= LoadImage(PLACEHOLDER_PATH);
 	music_placeholder_src = LoadImage(MUSIC_PLACEHOLDER_PATH);
 	dir_placeholder_src		= LoadImage(DIR_PLACEHOLDER_PATH);
@@ -1847,29 +6375,76 @@ int main(const int argc, char *argv[])
 	music_placeholder_texture =	LoadTextureFromImage(music_placeholder_src);
 	dir_placeholder_texture		=	LoadTextureFromImage(dir_placeholder_src);
 
-	fill_img_map(true);
+	refresh_placeholder_imgs(true);
 
 	std::thread preview_loader = std::thread(load_previews);
+	std::thread dir_scanner = std::thread(scan_dirs);
+	std::thread prefetcher = std::thread(prefetch_dirs);
+	std::vector<std::thread> dir_walkers = start_dir_walkers();
+	std::vector<std::thread> decoders = start_decoders();
+
+	load_dir();
 
 	while (!WindowShouldClose()) {
 		if (IsWindowResized()) update_tile_pos();
 		if (IsFileDropped()) handle_dropped_files();
+		poll_dir_scan();
+		poll_dir_watch();
+		poll_prefetch();
+		poll_dir_sizes();
+		update_decode_priorities();
+		poll_decoded_previews();
+		poll_memory();
+		upload_previews();
+		poll_scrub_hover();
 		BeginDrawing();
 			ClearBackground(BACKGROUND_COLOR);
 			render_files();
+			draw_scan_status();
 			handle_keyboard_input();
 			handle_mouse_input();
 		EndDrawing();
 	}
 
+	{
+		std::lock_guard<std::mutex> lock(scan_mtx);
+		stop_flag = true;
+		scan_cv.notify_all();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(prefetch_mtx);
+		prefetch_cv.notify_all();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(walk_mtx);
+		walk_cv.notify_all();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(decode_mtx);
+		decode_cv.notify_all();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(loader_mtx);
+		loader_cv.notify_all();
+	}
+
+	preview_loader.join();
+	dir_scanner.join();
+	prefetcher.join();
+	for (auto &walker: dir_walkers) walker.join();
+	for (auto &decoder: decoders) decoder.join();
+
 	for (const auto& proc: procs) {
 		nob_proc_kill(proc, true);
 	}
 
 	for (long i = 0; i < hmlen(img_map); ++i) {
 		if (!img_map[i].value.is_placeholder) {
-			UnloadImage(img_map[i].value.scaled_img);
-			UnloadImage(img_map[i].value.src_img);
+			unload_preview_img(img_map[i].value.scaled_img);
 			if (img_map[i].value.loaded_texture) {
 				UnloadTexture(*img_map[i].value.loaded_texture);
 			}
@@ -1880,6 +6455,10 @@ int main(const int argc, char *argv[])
 		UnloadTexture(texture);
 	}
 
+	for (const auto &strip: scrub_strips) {
+		UnloadTexture(strip.texture);
+	}
+
 	#define X UNLOAD_PLACEHOLDER
 	XPLACEHOLDERS
 	#undef X
@@ -1889,9 +6468,6 @@ int main(const int argc, char *argv[])
 	UnloadFont(font);
 	CloseWindow();
 
-	stop_flag = true;
-	preview_loader.join();
-
 	return 0;
 }
 